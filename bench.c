@@ -0,0 +1,602 @@
+// Load generator for the GopherChat server. One process plays thousands of scripted users over a single event loop.
+// Each user runs the same steps as a client script (REGISTER, LOGIN, then SEND2 or SEND messages and SENDF2 files to
+// another user) at the rates given on the command line, and the time from sending each message or file to the other
+// user receiving it is measured. Users, their peers, message timing and file contents all come from the seed, so two
+// runs with the same options put the same load on the server
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "protocol.h"
+
+#define MAX_USERS 99999 // User names are "u" and five digits
+#define MAX_CRED 8 // Longest username the server accepts
+#define BENCH_PASS "bench000"
+#define MAX_CONNECTING 64 // Most users connecting and logging in at once, so the server's accept backlog is not overrun
+#define SETUP_TIMEOUT 60 // Seconds all users have to log in
+#define MAX_EVENTS 1024
+#define TICK_MS 1 // How often due messages are sent
+#define CHANNEL_QUEUE (256 * 1024) // Bytes of file data queued on a data channel before more is read into it
+
+// States of a simulated user
+typedef enum {
+	USER_IDLE, // Not connected yet
+	USER_SETUP, // Registering and logging in
+	USER_RUNNING, // Logged in
+	USER_FAILED // Connection lost
+} user_state;
+
+// A buffer of bytes waiting to be sent or handled
+struct BUF {
+	char * data;
+	int len;
+	int off; // Bytes at the front that have already been sent or handled
+	int cap;
+};
+
+// A connection to the server
+struct CONN {
+	int fd;
+	struct BUF out;
+	struct BUF in;
+};
+
+// A simulated user, with its control connection and the data channel its files are uploaded over
+struct USER {
+	user_state state;
+	char name[MAX_CRED + 1];
+	int peer; // User its private messages and files go to
+	struct CONN ctl;
+	struct CONN chan; // fd is -1 until the first file is uploaded
+	uint64_t nextMsg; // When the next message is due
+	uint64_t seed; // Random state of the file being uploaded
+	int nUploaded; // Files whose PUTF has been queued
+	long upSent; // Bytes of the file being uploaded that have been queued
+	uint64_t * fileStart; // When each of its files started uploading
+	unsigned int pushID; // Id of the file being pushed to the user
+	int pushFrom; // User and file number of the file being pushed (pushFrom is -1 if none is)
+	int pushFile;
+	long pushSize;
+	long pushRecv;
+};
+
+// A growable list of latencies in nanoseconds
+struct SAMPLES {
+	uint64_t * at;
+	long len;
+	long cap;
+};
+
+struct USER * users;
+int nUsers = 100;
+double msgRate = 1; // Messages each user sends per second
+int duration = 10; // Seconds messages are sent for
+int drainTime = 10; // Seconds to wait for messages and files still on their way once sending stops
+long fileSize = 1024 * 1024;
+int nFiles; // Files each user uploads
+int broadcast; // Set when messages are sent to every user with SEND instead of to the peer with SEND2
+uint64_t seed = 1;
+int epollFD;
+struct sockaddr_in serverAddr;
+int nLoggedIn;
+int nFailed;
+long nSent; // Messages sent
+long nExpected; // Deliveries those messages should make
+long nDelivered;
+long nErrors; // ERROR commands received once running
+int nFilesDone;
+long fileBytes; // Bytes of files delivered
+uint64_t firstUpload; // When the first file started uploading and the last one finished arriving
+uint64_t lastDelivery;
+struct SAMPLES msgLatency;
+struct SAMPLES fileLatency;
+
+void Log(const char * format, ...) {
+	char msg[2048];
+	va_list argptr;
+	va_start(argptr, format);
+	vsnprintf(msg, sizeof(msg), format, argptr);
+	va_end(argptr);
+	fprintf(stderr, "%s\n", msg);
+}
+
+// Returns a monotonic time in nanoseconds
+uint64_t NowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*, the source of every random choice so runs with the same seed are the same
+uint64_t NextRandom(uint64_t * state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+void AddSample(struct SAMPLES * s, uint64_t ns) {
+	if (s->len == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 4096;
+		if ((s->at = (uint64_t *)realloc(s->at, sizeof(uint64_t) * s->cap)) == NULL) {
+			Log("Cannot grow the latency samples to %ld entries.", s->cap);
+			exit(-1);
+		}
+	}
+	s->at[s->len++] = ns;
+}
+
+int CompareSamples(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Returns the sample under which a fraction of the sorted samples fall, in milliseconds
+double Percentile(struct SAMPLES * s, double fraction) {
+	if (s->len == 0)
+		return 0;
+	long k = (long)(fraction * (s->len - 1) + 0.5);
+	return s->at[k] / 1e6;
+}
+
+// Makes room for len more bytes at the end of a buffer, dropping the part that has been handled
+void Reserve(struct BUF * b, int len) {
+	if (b->off > 0 && b->len + len > b->cap) {
+		memmove(b->data, b->data + b->off, b->len - b->off);
+		b->len -= b->off;
+		b->off = 0;
+	}
+	if (b->len + len <= b->cap)
+		return;
+	while (b->cap < b->len + len)
+		b->cap = b->cap ? b->cap * 2 : 4096;
+	if ((b->data = (char *)realloc(b->data, b->cap)) == NULL) {
+		Log("Cannot grow a connection buffer to %d bytes.", b->cap);
+		exit(-1);
+	}
+}
+
+// Returns the epoll tag of a user's connection
+uint64_t ConnTag(int u, struct CONN * c) {
+	return (uint64_t)u * 2 + (c == &users[u].chan);
+}
+
+// Watches a connection for input, and for output while it has anything waiting to be sent
+void Watch(int u, struct CONN * c, int op) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN | ((c->out.len > c->out.off) ? EPOLLOUT : 0);
+	ev.data.u64 = ConnTag(u, c);
+	if (epoll_ctl(epollFD, op, c->fd, &ev) != 0) {
+		Log("Cannot watch a connection (%d: %s).", errno, strerror(errno));
+		exit(-1);
+	}
+}
+
+// Queues a v2 frame on a connection
+void QueueFrame(int u, struct CONN * c, int type, const char * body, int len) {
+	int wasEmpty = (c->out.len == c->out.off);
+	Reserve(&c->out, FRAME_HDR_LEN + len);
+	PutFrameHeader((BYTE *)c->out.data + c->out.len, type, len);
+	memcpy(c->out.data + c->out.len + FRAME_HDR_LEN, body, len);
+	c->out.len += FRAME_HDR_LEN + len;
+	if (wasEmpty)
+		Watch(u, c, EPOLL_CTL_MOD);
+}
+
+void QueueCmd(int u, struct CONN * c, int type, const char * format, ...) {
+	char body[CMD_LEN];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = vsnprintf(body, sizeof(body), format, argptr);
+	va_end(argptr);
+	QueueFrame(u, c, type, body, len);
+}
+
+// Opens a non-blocking connection to the server
+int Connect(int u, struct CONN * c) {
+	if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (const struct sockaddr *)&serverAddr, sizeof(serverAddr)) != 0 && errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	Watch(u, c, EPOLL_CTL_ADD);
+	return 0;
+}
+
+void Fail(int u, const char * why) {
+	struct USER * user = &users[u];
+	if (user->state == USER_FAILED)
+		return;
+	Log("ERROR: User '%s' %s.", user->name, why);
+	if (user->state == USER_SETUP)
+		nLoggedIn++; // Counted as done with setup, so the others do not wait for it
+	user->state = USER_FAILED;
+	nFailed++;
+	close(user->ctl.fd);
+	if (user->chan.fd >= 0)
+		close(user->chan.fd);
+}
+
+// Connects a user, and queues the HELLO asking for files to be pushed along with the user's REGISTER and LOGIN.
+// REGISTER fails harmlessly if an earlier run already registered the user
+void StartUser(int u) {
+	struct USER * user = &users[u];
+	user->state = USER_SETUP;
+	if (Connect(u, &user->ctl) < 0) {
+		Fail(u, "cannot connect to the server");
+		return;
+	}
+	QueueCmd(u, &user->ctl, HELLO, "2 %s", PUSH_CAPABILITY);
+	QueueCmd(u, &user->ctl, REGISTER, "%s %s", user->name, BENCH_PASS);
+	QueueCmd(u, &user->ctl, LOGIN, "%s %s", user->name, BENCH_PASS);
+}
+
+// Sends a message stamped with the time it was sent, which the users receiving it use to measure its latency
+void SendMessage(int u, uint64_t now) {
+	struct USER * user = &users[u];
+	if (broadcast) {
+		QueueCmd(u, &user->ctl, SEND, "t%llu", (unsigned long long)now);
+		nExpected += nUsers - nFailed;
+	}
+	else {
+		QueueCmd(u, &user->ctl, SEND2, "%s t%llu", users[user->peer].name, (unsigned long long)now);
+		nExpected++;
+	}
+	nSent++;
+}
+
+// Queues the next part of a user's uploads on its data channel, up to CHANNEL_QUEUE bytes. Each file is a PUTF command
+// followed by FILEDATA frames, and the next file starts as soon as the last one has been queued
+void FeedChannel(int u) {
+	struct USER * user = &users[u];
+	while (user->chan.out.len - user->chan.out.off < CHANNEL_QUEUE) {
+		if (user->upSent == fileSize) {
+			if (user->nUploaded == nFiles)
+				return;
+			int k = user->nUploaded++;
+			user->fileStart[k] = NowNs();
+			if (firstUpload == 0)
+				firstUpload = user->fileStart[k];
+			user->seed = seed ^ ((uint64_t)u << 32) ^ (uint64_t)(k + 1) * 0x9E3779B97F4A7C15ULL;
+			user->upSent = 0;
+			QueueCmd(u, &user->chan, PUTF, "%d %s %s %ld %s.%d", k + 1, user->name, users[user->peer].name, fileSize, user->name, k);
+			continue;
+		}
+
+		// The file's contents are random bytes from its own seed, so it does not shrink and is not shared with other files
+		BYTE chunk[PUSH_ID_LEN + PUSH_CHUNK];
+		int n = (fileSize - user->upSent < PUSH_CHUNK) ? fileSize - user->upSent : PUSH_CHUNK;
+		unsigned int id = user->nUploaded;
+		chunk[0] = (BYTE)(id >> 24);
+		chunk[1] = (BYTE)(id >> 16);
+		chunk[2] = (BYTE)(id >> 8);
+		chunk[3] = (BYTE)id;
+		for (int k = 0; k < n; k += 8) {
+			uint64_t r = NextRandom(&user->seed);
+			memcpy(chunk + PUSH_ID_LEN + k, &r, (n - k < 8) ? n - k : 8);
+		}
+		QueueFrame(u, &user->chan, FILEDATA, (char *)chunk, PUSH_ID_LEN + n);
+		user->upSent += n;
+	}
+}
+
+// Opens a user's data channel and starts uploading its files
+void StartUploads(int u) {
+	struct USER * user = &users[u];
+	if (Connect(u, &user->chan) < 0) {
+		Fail(u, "cannot open a data channel");
+		return;
+	}
+	user->upSent = fileSize;
+	FeedChannel(u);
+}
+
+// A message arrived. Private ones read "[<sender>->you]: t<time>" and public ones "<sender>: t<time>". The copy of a
+// private message echoed back to its sender, and notices like logins, are not counted
+void RecvPrint(const char * body, uint64_t now) {
+	if (!strncmp(body, "[you->", 6))
+		return;
+	const char * stamp = strstr(body, ": t");
+	if (stamp == NULL)
+		return;
+	char * end;
+	unsigned long long sent = strtoull(stamp + 3, &end, 10);
+	if (end == stamp + 3 || *end != '\0')
+		return;
+	AddSample(&msgLatency, now - sent);
+	nDelivered++;
+}
+
+// A file started being pushed to a user. body is "<id> <sender> <size> <filename>", and benchmark files are named
+// "<sender>.<number>"
+void RecvPushf(int u, char * body) {
+	struct USER * user = &users[u];
+	char sender[MAX_CRED + 1], filename[MAX_CRED + 16];
+	int k;
+	user->pushFrom = -1;
+	if (sscanf(body, "%u %8s %ld %23s", &user->pushID, sender, &user->pushSize, filename) != 4 || sender[0] != 'u'
+			|| sscanf(filename + strlen(sender), ".%d", &k) != 1 || atoi(sender + 1) >= nUsers || k < 0 || k >= nFiles)
+		return;
+	user->pushFrom = atoi(sender + 1);
+	user->pushFile = k;
+	user->pushRecv = 0;
+}
+
+// A chunk of the file being pushed to a user arrived
+void RecvChunk(int u, const BYTE * body, int len, uint64_t now) {
+	struct USER * user = &users[u];
+	if (len < PUSH_ID_LEN || user->pushFrom < 0)
+		return;
+	unsigned int id = ((unsigned int)body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3];
+	if (id != user->pushID)
+		return;
+	user->pushRecv += len - PUSH_ID_LEN;
+	if (user->pushRecv < user->pushSize)
+		return;
+
+	AddSample(&fileLatency, now - users[user->pushFrom].fileStart[user->pushFile]);
+	fileBytes += user->pushSize;
+	nFilesDone++;
+	lastDelivery = now;
+	user->pushFrom = -1;
+}
+
+// Acts on a command the server sent to a user
+void Handle(int u, struct CONN * c, int type, char * body, int len, uint64_t now) {
+	struct USER * user = &users[u];
+	switch (type) {
+		case HELLO:
+			if (strstr(body, PUSH_CAPABILITY) == NULL)
+				Fail(u, "was not offered pushed files by the server");
+			break;
+		case LOGIN:
+			user->state = USER_RUNNING;
+			nLoggedIn++;
+			break;
+		case ERROR:
+			// The only expected failure is registering a user that an earlier run registered
+			if (user->state == USER_SETUP && strstr(body, "already exists") != NULL)
+				break;
+			if (user->state == USER_SETUP) {
+				Log("ERROR: User '%s' cannot log in: %s", user->name, body);
+				Fail(u, "could not log in");
+				break;
+			}
+			nErrors++;
+			break;
+		case PRINT:
+			RecvPrint(body, now);
+			break;
+		case PUSHF:
+			RecvPushf(u, body);
+			break;
+		case FILEDATA:
+			RecvChunk(u, (BYTE *)body, len, now);
+			break;
+		case ACKF:
+			break;
+		default:
+			nErrors++;
+	}
+}
+
+// Sends what a connection has waiting, and tops up a data channel with more of its uploads
+int WriteConn(int u, struct CONN * c) {
+	while (c->out.off < c->out.len) {
+		int n = send(c->fd, c->out.data + c->out.off, c->out.len - c->out.off, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n < 0)
+			return -1;
+		c->out.off += n;
+		if (c->out.off == c->out.len && c == &users[u].chan)
+			FeedChannel(u);
+	}
+	c->out.len = c->out.off = 0;
+	Watch(u, c, EPOLL_CTL_MOD);
+	return 0;
+}
+
+// Receives what has arrived on a connection and handles every whole frame in it
+int ReadConn(int u, struct CONN * c) {
+	uint64_t now = NowNs();
+	while (1) {
+		Reserve(&c->in, FRAME_HDR_LEN + MAX_BODY_LEN + 1);
+		int n = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len - 1, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			return -1;
+		c->in.len += n;
+
+		int type, len;
+		while (c->in.len - c->in.off >= FRAME_HDR_LEN) {
+			char * frame = c->in.data + c->in.off;
+			if (GetFrameHeader((BYTE *)frame, &type, &len) < 0)
+				return -1;
+			if (c->in.len - c->in.off < FRAME_HDR_LEN + len)
+				break;
+
+			// Terminate the body in place for the text commands, saving the byte it covers
+			char saved = frame[FRAME_HDR_LEN + len];
+			frame[FRAME_HDR_LEN + len] = '\0';
+			Handle(u, c, type, frame + FRAME_HDR_LEN, len, now);
+			frame[FRAME_HDR_LEN + len] = saved;
+			if (users[u].state == USER_FAILED)
+				return 0;
+			c->in.off += FRAME_HDR_LEN + len;
+		}
+		if (c->in.off == c->in.len)
+			c->in.len = c->in.off = 0;
+	}
+}
+
+// Handles the events epoll reported, until timeoutMs passes without any
+void RunEvents(int timeoutMs) {
+	struct epoll_event events[MAX_EVENTS];
+	int n = epoll_wait(epollFD, events, MAX_EVENTS, timeoutMs);
+	for (int k = 0; k < n; k++) {
+		int u = events[k].data.u64 / 2;
+		struct CONN * c = (events[k].data.u64 & 1) ? &users[u].chan : &users[u].ctl;
+		if (users[u].state == USER_FAILED)
+			continue;
+		if ((events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && ReadConn(u, c) < 0) {
+			Fail(u, (c == &users[u].chan) ? "lost its data channel" : "lost its connection");
+			continue;
+		}
+		if (users[u].state != USER_FAILED && (events[k].events & EPOLLOUT) && WriteConn(u, c) < 0)
+			Fail(u, (c == &users[u].chan) ? "lost its data channel" : "lost its connection");
+	}
+}
+
+void Usage(const char * name) {
+	Log("Proper usage: '%s [-u users] [-r messages per second per user] [-d seconds] [-b] [-f file bytes] [-n files per user] [-w drain seconds] [-S seed] [Server IP Address] [Server Port]'", name);
+	Log("The server needs a connection limit (-c) of at least twice the number of users.");
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+
+	InitMsgTable();
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((opt = getopt(argc, argv, "u:r:d:bf:n:w:S:")) != -1) {
+		switch (opt) {
+			case 'u': nUsers = atoi(optarg); break;
+			case 'r': msgRate = atof(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'b': broadcast = 1; break;
+			case 'f': fileSize = atol(optarg); break;
+			case 'n': nFiles = atoi(optarg); break;
+			case 'w': drainTime = atoi(optarg); break;
+			case 'S': seed = strtoull(optarg, NULL, 10); break;
+			default:
+				Usage(argv[0]);
+				return -1;
+		}
+	}
+	if (argc - optind != 2 || nUsers < 2 || nUsers > MAX_USERS || msgRate < 0 || duration <= 0 || fileSize < 0 || nFiles < 0 || drainTime < 0 || seed == 0) {
+		Usage(argv[0]);
+		return -1;
+	}
+
+	memset(&serverAddr, 0, sizeof(serverAddr));
+	serverAddr.sin_family = AF_INET;
+	serverAddr.sin_port = htons((unsigned short)atoi(argv[optind + 1]));
+	if (inet_pton(AF_INET, argv[optind], &serverAddr.sin_addr) != 1) {
+		Usage(argv[0]);
+		return -1;
+	}
+
+	// Every user takes one or two descriptors, which is more than the default limit allows for large runs
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	if ((epollFD = epoll_create1(0)) < 0 || (users = (struct USER *)calloc(nUsers, sizeof(struct USER))) == NULL) {
+		Log("Cannot set up %d users.", nUsers);
+		return -1;
+	}
+	uint64_t rnd = seed;
+	for (int u = 0; u < nUsers; u++) {
+		snprintf(users[u].name, sizeof(users[u].name), "u%05d", u % (MAX_USERS + 1));
+		users[u].peer = (u + 1 + NextRandom(&rnd) % (nUsers - 1)) % nUsers;
+		users[u].ctl.fd = -1;
+		users[u].chan.fd = -1;
+		users[u].pushFrom = -1;
+		if (nFiles > 0 && (users[u].fileStart = (uint64_t *)calloc(nFiles, sizeof(uint64_t))) == NULL) {
+			Log("Cannot set up %d users.", nUsers);
+			return -1;
+		}
+	}
+
+	// Log everyone in, a few at a time. Each login is announced to every user already online, so this is timed on its own
+	uint64_t setupStart = NowNs();
+	int nStarted = 0;
+	while (nLoggedIn < nUsers) {
+		while (nStarted < nUsers && nStarted - nLoggedIn < MAX_CONNECTING)
+			StartUser(nStarted++);
+		RunEvents(TICK_MS);
+		if (NowNs() - setupStart > (uint64_t)SETUP_TIMEOUT * 1000000000) {
+			Log("ERROR: Only %d of %d users logged in within %d seconds.", nLoggedIn, nUsers, SETUP_TIMEOUT);
+			return -1;
+		}
+	}
+	double setupSecs = (NowNs() - setupStart) / 1e9;
+	if (nFailed == nUsers) {
+		Log("ERROR: No user could log in.");
+		return -1;
+	}
+
+	// Send messages for the given duration, each user at its own steady rate starting at a random point of its first
+	// interval, while the files are uploaded
+	uint64_t interval = (msgRate > 0) ? (uint64_t)(1e9 / msgRate) : 0;
+	uint64_t start = NowNs();
+	for (int u = 0; u < nUsers; u++) {
+		users[u].nextMsg = start + (interval ? NextRandom(&rnd) % interval : 0);
+		if (nFiles > 0 && users[u].state == USER_RUNNING)
+			StartUploads(u);
+	}
+	uint64_t stop = start + (uint64_t)duration * 1000000000;
+	uint64_t now;
+	while ((now = NowNs()) < stop) {
+		for (int u = 0; interval && u < nUsers; u++) {
+			while (users[u].state == USER_RUNNING && users[u].nextMsg <= now && users[u].nextMsg < stop) {
+				SendMessage(u, now);
+				users[u].nextMsg += interval;
+			}
+		}
+		RunEvents(TICK_MS);
+	}
+
+	// Wait for what is still on its way
+	uint64_t drainEnd = stop + (uint64_t)drainTime * 1000000000;
+	int filesExpected = 0;
+	while ((now = NowNs()) < drainEnd) {
+		filesExpected = 0;
+		for (int u = 0; u < nUsers; u++)
+			filesExpected += (users[u].state == USER_RUNNING && users[users[u].peer].state == USER_RUNNING) ? nFiles : 0;
+		if (nDelivered >= nExpected && nFilesDone >= filesExpected)
+			break;
+		RunEvents(TICK_MS);
+	}
+
+	qsort(msgLatency.at, msgLatency.len, sizeof(uint64_t), CompareSamples);
+	qsort(fileLatency.at, fileLatency.len, sizeof(uint64_t), CompareSamples);
+	printf("users %d (%d failed), %s messages at %g/s each for %d s, %d files of %ld bytes each, seed %llu\n",
+		nUsers, nFailed, broadcast ? "public" : "private", msgRate, duration, nFiles, fileSize, (unsigned long long)seed);
+	printf("login: %.2f s (%.0f users/s)\n", setupSecs, nUsers / setupSecs);
+	printf("messages: %ld sent, %ld of %ld deliveries (%.0f/s), %ld errors\n", nSent, nDelivered, nExpected, nDelivered / (double)duration, nErrors);
+	printf("message latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+		Percentile(&msgLatency, 0.5), Percentile(&msgLatency, 0.9), Percentile(&msgLatency, 0.99), Percentile(&msgLatency, 1));
+	if (nFiles > 0) {
+		double secs = (lastDelivery > firstUpload) ? (lastDelivery - firstUpload) / 1e9 : 0;
+		printf("files: %d of %d delivered, %.1f MB in %.2f s (%.1f MB/s)\n", nFilesDone, filesExpected, fileBytes / 1e6, secs, secs > 0 ? fileBytes / 1e6 / secs : 0);
+		printf("file latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+			Percentile(&fileLatency, 0.5), Percentile(&fileLatency, 0.9), Percentile(&fileLatency, 0.99), Percentile(&fileLatency, 1));
+	}
+	return (nFailed > 0 || nDelivered < nExpected || nFilesDone < filesExpected) ? 1 : 0;
+}
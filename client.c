@@ -13,70 +13,14 @@
 #include <poll.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "protocol.h"
 
-#define MAX_REQUEST_SIZE 10000000
-#define CMD_LEN 300
+#define MAX_REQUEST_SIZE (16L * 1024 * 1024 * 1024) // Largest file that can be uploaded
+#define FILE_CHUNK 65536 // Most bytes of a downloaded file held in memory before they are written to disk
 #define MAX_CONCURRENCY_LIMIT 8
-
-typedef unsigned char BYTE;
-
-// protocol messages
-typedef enum {
-	IDLE,
-	REGISTER,
-	LOGIN,
-	LOGOUT,
-	SEND,
-	SEND2,
-	SENDA,
-	SENDA2,
-	SENDF,
-	SENDF2,
-	LIST,
-	DELAY,
-	PRINT,
-	ERROR,
-	LISTEN,
-	RECV
-} msg_type;
-
-// converting string (from script) to enumerated protocol message
-msg_type strToMsg (char *msg) {
-	if (!strcmp(msg, "IDLE"))
-		return IDLE;
-	else if (!strcmp(msg, "REGISTER"))
-		return REGISTER;
-	else if (!strcmp(msg, "LOGIN"))
-		return LOGIN;
-	else if (!strcmp(msg, "LOGOUT\n"))
-		return LOGOUT;
-	else if (!strcmp(msg, "SEND"))
-		return SEND;
-	else if (!strcmp(msg, "SEND2"))
-		return SEND2;
-	else if (!strcmp(msg, "SENDA"))
-		return SENDA;
-	else if (!strcmp(msg, "SENDA2"))
-		return SENDA2;
-	else if (!strcmp(msg, "SENDF"))
-		return SENDF;
-	else if (!strcmp(msg, "SENDF2"))
-		return SENDF2;
-	else if (!strcmp(msg, "LIST\n"))
-		return LIST;
-	else if (!strcmp(msg, "DELAY"))
-		return DELAY;
-	else if (!strcmp(msg, "PRINT"))
-		return PRINT;
-	else if (!strcmp(msg, "ERROR"))
-		return ERROR;
-	else if (!strcmp(msg, "LISTEN"))
-		return LISTEN;
-	else if (!strcmp(msg, "RECV"))
-		return RECV;
-	else
-		return -1;
-}
+#define TRANSFER_RETRIES 3 // Times an interrupted upload or download is resumed before it is given up
 
 struct CONN_STAT {
 	int msg;
@@ -84,15 +28,53 @@ struct CONN_STAT {
 	int nCmdRecv;
 	int nSent;
 	int nStatSent;
-	int filesize;
+	long filesize;
 	int loggedIn;
-	char *file;
+	int cmdLen; // Number of bytes of cmdSend to send
+	int fileFD; // File being uploaded or downloaded (-1 if none is)
+	off_t fileOff; // Bytes of the file that have been sent or received
+	char *args; // Arguments of the last command received, inside cmdRecv
+	int argsLen; // Length of args
+	int channel; // Set on the data channel that uploads are multiplexed over
+	int compress; // Set once the server has agreed to compressed file chunks on this connection
+	int greeting; // Set on the data channel until the server has answered its HELLO
+	int connecting; // Set while the connection to the server is still being set up
+	int retries; // Times the download on this connection has been resumed
+	char request[CMD_LEN]; // Body of the LISTEN command for the download on this connection, to resume it with
 	char user[8];
 	char filename[33];
-	char cmdSend[CMD_LEN];
-	char cmdRecv[CMD_LEN];
+	char cmdSend[FRAME_HDR_LEN + MAX_BODY_LEN];
+	char cmdRecv[FRAME_HDR_LEN + MAX_BODY_LEN + 1];
+};
+
+// An upload sent as a stream over the data channel
+struct STREAM {
+	struct STREAM *next;
+	int fileFD;
+	long filesize;
+	long nSent; // Bytes of the file that have been put into FILEDATA frames
+	int started; // Set once the PUTF command has been put into a frame
+	int resume; // Set when the stream was interrupted, so it starts again with RESUMEF instead of PUTF
+	int waiting; // Set while waiting for the server to answer RESUMEF with the offset to carry on from
+	unsigned int id;
+	char xfer[XFER_LEN + 1]; // Transfer id the server keeps the partial upload under (empty if it cannot be resumed)
+	char filename[33];
+	char cmd[CMD_LEN]; // Body of the PUTF command that starts the stream
 };
 
+framing_type framing; // Framing used for every connection to the server
+int multiplex; // Set when uploads share one long-lived data channel instead of each opening a new connection
+struct STREAM *streamHead; // Uploads that have not been saved by the server yet, in the order they are sent
+struct STREAM *streamTail;
+unsigned int nextStream; // Id given to the last upload
+int channelRetries; // Times the data channel has been reopened since the server last saved an upload
+int pushFiles; // Set when the client asks the server to push files over the control connection instead of sending LISTEN
+int compressFiles; // Set when the client offers to send and receive compressed file chunks
+FILE *pushFile; // File being pushed by the server (NULL if none is, or if it could not be created)
+unsigned int pushID; // Id the server gave the file being pushed
+long pushSize; // Size of the file being pushed
+long pushRecv; // Bytes of the file being pushed that have been written
+char pushName[33];
 int eof;
 int connected;
 int timeout;
@@ -121,25 +103,32 @@ void Log(const char * format, ...) {
 	fprintf(stderr, "%s\n", msg);
 }
 
-msg_type cmdToMsg (char *str) {
-	msg_type msg;
-
-	// Temporarily change the first space into a null character
-	char *split = strchr(str, ' ');
-	if (split != NULL)
-		*split = '\0';
+// Encodes a command line (as written in the input script) into the send buffer of connection i, using the
+// framing the client was started with. Returns the command type, or -1 if the command is unknown
+int SetCommand(int i, const char * line) {
+	const char * body = strchr(line, ' ');
+	int nameLen = (body != NULL) ? body - line : strlen(line);
+	int type = MsgFromName(line, nameLen);
 	
-	// Convert the command string to its corresponding enumerated value
-	if ((msg = strToMsg(str)) == -1) {
-		Log("ERROR: Unknown message %d", msg);
-		return -1;
+	// v1 frames are the script line itself, padded to CMD_LEN bytes
+	if (framing == FRAMING_V1) {
+		memset(connStat[i].cmdSend, 0, CMD_LEN);
+		snprintf(connStat[i].cmdSend, CMD_LEN, "%s", line);
+		connStat[i].cmdLen = CMD_LEN;
+		if (type == -1)
+			Log("ERROR: Unknown message %.*s", nameLen, line);
+		return type;
 	}
 	
-	// Return the space
-	if (split != NULL)
-		*split = ' ';
-	
-	return msg;
+	// v2 frames cannot carry a command the client does not know, so an IDLE is sent in its place
+	if (type == -1) {
+		Log("ERROR: Unknown message %.*s", nameLen, line);
+		connStat[i].cmdLen = EncodeFrame(connStat[i].cmdSend, framing, IDLE, "", 0);
+		return -1;
+	}
+	body = (body != NULL) ? body + 1 : "";
+	connStat[i].cmdLen = EncodeFrame(connStat[i].cmdSend, framing, type, body, strlen(body));
+	return type;
 }
 
 int Send_NonBlocking(int sockFD, const BYTE * data, int len, struct CONN_STAT * pStat, struct pollfd * pPeer) {	
@@ -189,6 +178,53 @@ int Recv_NonBlocking(int sockFD, BYTE * data, int len, struct CONN_STAT * pStat,
 	return 0;
 }
 
+// Receives the next command from the server on connection i. On success the command type is stored in msg and
+// its arguments in args. Returns 1 once the whole command has arrived, 0 if the socket would block, or -1 if
+// the connection failed
+int RecvFrame(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	
+	if (framing == FRAMING_V1) {
+		if (Recv_NonBlocking(peers[i].fd, stat->cmdRecv, CMD_LEN, stat, &peers[i]) < 0)
+			return -1;
+		if (stat->nRecv < CMD_LEN)
+			return 0;
+		stat->nRecv = 0;
+		stat->cmdRecv[CMD_LEN] = '\0';
+		
+		// The command name runs up to the first space, and its arguments follow it
+		int nameLen = strcspn(stat->cmdRecv, " ");
+		stat->args = stat->cmdRecv + nameLen + (stat->cmdRecv[nameLen] == ' ');
+		stat->argsLen = strlen(stat->args);
+		stat->msg = MsgFromName(stat->cmdRecv, nameLen);
+		return 1;
+	}
+	
+	// v2 frames are received in two steps: the fixed size header, then the body whose length it gives
+	int type, len;
+	if (stat->nRecv < FRAME_HDR_LEN) {
+		if (Recv_NonBlocking(peers[i].fd, stat->cmdRecv, FRAME_HDR_LEN, stat, &peers[i]) < 0)
+			return -1;
+		if (stat->nRecv < FRAME_HDR_LEN)
+			return 0;
+	}
+	if (GetFrameHeader(stat->cmdRecv, &type, &len) < 0) {
+		Log("ERROR: Invalid frame header received from server.");
+		return -1;
+	}
+	if (Recv_NonBlocking(peers[i].fd, stat->cmdRecv, FRAME_HDR_LEN + len, stat, &peers[i]) < 0)
+		return -1;
+	if (stat->nRecv < FRAME_HDR_LEN + len)
+		return 0;
+	
+	stat->nRecv = 0;
+	stat->msg = type;
+	stat->args = stat->cmdRecv + FRAME_HDR_LEN;
+	stat->args[len] = '\0';
+	stat->argsLen = len;
+	return 1;
+}
+
 void SetNonBlockIO(int fd) {
 	int val = fcntl(fd, F_GETFL, 0);
 	if (fcntl(fd, F_SETFL, val | O_NONBLOCK) != 0) {
@@ -197,13 +233,55 @@ void SetNonBlockIO(int fd) {
 	}
 }
 
+// Give up on every upload that has not been saved by the server
+void dropStreams() {
+	while (streamHead != NULL) {
+		struct STREAM *next = streamHead->next;
+		Log("ERROR: Data channel closed, file '%s' was not sent.", streamHead->filename);
+		close(streamHead->fileFD);
+		free(streamHead);
+		streamHead = next;
+	}
+	streamTail = NULL;
+	channelRetries = 0;
+}
+
+int openChannel();
+
 void RemoveConnection(int i) {
+	// Uploads that have not been saved are carried on over a new data channel. Those that were started are resumed
+	// where the server's copy ends, or started over if they cannot be resumed
+	int reopen = 0;
+	if (connStat[i].channel && streamHead != NULL) {
+		if (channelRetries < TRANSFER_RETRIES) {
+			Log("INFO: Data channel lost, reopening it (attempt %d).", ++channelRetries);
+			for (struct STREAM *stream = streamHead; stream != NULL; stream = stream->next) {
+				if (stream->started) {
+					stream->resume = (stream->xfer[0] != '\0');
+					stream->started = 0;
+					stream->waiting = 0;
+					stream->nSent = 0;
+					lseek(stream->fileFD, 0, SEEK_SET);
+				}
+			}
+			reopen = 1;
+		}
+		else {
+			dropStreams();
+		}
+	}
+	
+	if (connStat[i].fileFD >= 0)
+		close(connStat[i].fileFD);
 	close(peers[i].fd);	
 	if (i < nConns) {	
 		memmove(peers + i, peers + i + 1, (nConns-i) * sizeof(struct pollfd));
 		memmove(connStat + i, connStat + i + 1, (nConns-i) * sizeof(struct CONN_STAT));
 	}
 	nConns--;
+	
+	if (reopen && openChannel() < 0)
+		dropStreams();
 }
 
 // log in the user on the client side
@@ -220,19 +298,299 @@ void logout(int i) {
 	memset(connStat[i].user, 0, 8);
 }
 
-// Create a socket connection to send a file to the server
-void createDataSocket(int type, char *cmd) {
-	// Create a non-blocking socket and connect it to the server
+// Opens a file to be uploaded and finds its size. Uploads are read from disk as they are sent, so the file is never held
+// in memory. Returns the file descriptor, or -1 if the file cannot be sent
+int openUpload(const char *filename, long *size) {
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		Log("ERROR: Cannot open file '%s'. Does it exist?", filename);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	
+	// If the file is over MAX_REQUEST_SIZE bytes, it cannot be sent
+	if (st.st_size > MAX_REQUEST_SIZE) {
+		Log("ERROR: This file is %ld bytes, which is larger than the maximum file size of %ld bytes.", (long)st.st_size, MAX_REQUEST_SIZE);
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	return fd;
+}
+
+// Send as much of an upload as the socket will take, straight from the file with sendfile(). Returns 0 if the file
+// was sent or the socket would block, or -1 if the connection failed
+int sendFile(int i) {
+	struct CONN_STAT *stat = &connStat[i];
+	
+	while (stat->fileOff < stat->filesize) {
+		ssize_t n = sendfile(peers[i].fd, stat->fileFD, &stat->fileOff, stat->filesize - stat->fileOff);
+		if (n > 0) {
+			continue;
+		} else if (n == 0) {
+			Log("ERROR: File '%s' ended after %ld of %ld bytes.", stat->filename, (long)stat->fileOff, stat->filesize);
+			return -1;
+		} else if (errno == EWOULDBLOCK) {
+			//The socket becomes non-writable. OS will notify us when we can write
+			peers[i].events |= POLLWRNORM;
+			return 0;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+	peers[i].events &= ~POLLWRNORM;
+	return 0;
+}
+
+// Open a non-blocking socket to the server for a data connection. The connection is usually still being set up when
+// this returns, in which case connecting is set and poll() reports the socket writable once it is done, so the
+// client never waits for the handshake. Returns the socket, or -1 if the connection failed right away
+int connectServer(int *connecting) {
 	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	int conn = connect(fd, (const struct sockaddr *) &serverAddr, sizeof(serverAddr));
+	if (fd == -1) {
+		Log("ERROR: Cannot create a socket (%s).", strerror(errno));
+		return -1;
+	}
 	SetNonBlockIO(fd);
+	
+	*connecting = 0;
+	if (connect(fd, (const struct sockaddr *) &serverAddr, sizeof(serverAddr)) == -1) {
+		if (errno != EINPROGRESS) {
+			Log("ERROR: Failed to connect to the server (%s).", strerror(errno));
+			close(fd);
+			return -1;
+		}
+		*connecting = 1;
+	}
+	return fd;
+}
+
+// Finish setting up a data connection once poll() reports its socket. Returns 0 once the connection is up, or -1 if it failed
+int finishConnect(int i) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (getsockopt(peers[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err != 0) {
+		Log("ERROR: Failed to connect to the server (%s).", strerror(err));
+		return -1;
+	}
+	connStat[i].connecting = 0;
+	return 0;
+}
+
+// Returns the connection index of the data channel, or -1 if it is not open
+int findChannel() {
+	for (int i=1; i<=nConns; i++) {
+		if (connStat[i].channel)
+			return i;
+	}
+	return -1;
+}
+
+// Open the data channel if it is not open yet, and have it send the uploads waiting for it. Returns the
+// connection index of the channel, or -1 if it cannot be opened
+int openChannel() {
+	int i = findChannel();
+	if (i < 0) {
+		if (nConns == MAX_CONCURRENCY_LIMIT) {
+			Log("ERROR: Too many connections to open the data channel.");
+			return -1;
+		}
+		int connecting;
+		int fd = connectServer(&connecting);
+		if (fd == -1) {
+			Log("ERROR: Failed to open the data channel.");
+			return -1;
+		}
+		i = ++nConns;
+		peers[i].fd = fd;
+		peers[i].revents = 0;
+		memset(&connStat[i], 0, sizeof(struct CONN_STAT));
+		connStat[i].channel = 1;
+		connStat[i].connecting = connecting;
+		connStat[i].fileFD = -1;
+		
+		// Compression is agreed on separately for each connection, so the channel starts with a HELLO of its own,
+		// and waits for the answer before sending any file
+		if (compressFiles) {
+			connStat[i].cmdLen = EncodeFrame(connStat[i].cmdSend, FRAMING_V2, HELLO, "2 " COMPRESS_CAPABILITY, strlen("2 " COMPRESS_CAPABILITY));
+			connStat[i].greeting = 1;
+		}
+	}
+	peers[i].events = POLLRDNORM | POLLWRNORM;
+	return i;
+}
+
+// Queue a file to be uploaded as a stream over the data channel, opening the channel if it is not open yet.
+// The channel stays open for every later upload, so uploads do not pay for a new connection each
+void queueUpload(int type, char *cmd) {
+	char target[9] = "*";
+	char filename[33];
+	int parsed = (type == SENDF) ? sscanf(cmd, "%*s %32[^\n]", filename) : sscanf(cmd, "%*s %8s %32[^\n]", target, filename) - 1;
+	if (parsed != 1) {
+		Log("ERROR: Invalid file upload '%s'.", cmd);
+		return;
+	}
+	
+	struct STREAM *stream = (struct STREAM *)calloc(1, sizeof(struct STREAM));
+	if ((stream->fileFD = openUpload(filename, &stream->filesize)) < 0) {
+		free(stream);
+		return;
+	}
+	stream->id = ++nextStream;
+	sprintf(stream->filename, "%s", filename);
+	
+	// The transfer id only has to tell this upload apart from others of the same file that the server may still hold
+	snprintf(stream->xfer, sizeof(stream->xfer), "%06x%06x%04x", (unsigned int)getpid() & 0xffffff, (unsigned int)time(NULL) & 0xffffff, stream->id & 0xffff);
+	snprintf(stream->cmd, CMD_LEN, "%u:%s %s %s %ld %s", stream->id, stream->xfer, connStat[0].user, target, stream->filesize, filename);
+	
+	if (openChannel() < 0) {
+		close(stream->fileFD);
+		free(stream);
+		return;
+	}
+	
+	if (streamTail != NULL)
+		streamTail->next = stream;
+	else
+		streamHead = stream;
+	streamTail = stream;
+}
+
+// Send the uploads waiting for the data channel, one after another. Each one is a PUTF command followed by
+// FILEDATA frames holding the file. Uploads are kept until the server has saved them, so they can be resumed if
+// the channel is lost
+void sendStreams(int i) {
+	struct CONN_STAT *stat = &connStat[i];
+	
+	while (1) {
+		// Finish sending the frame in progress first
+		if (stat->nSent < stat->cmdLen) {
+			if (Send_NonBlocking(peers[i].fd, stat->cmdSend, stat->cmdLen, stat, &peers[i]) < 0) {
+				Log("ERROR: Data channel lost.");
+				RemoveConnection(i);
+				return;
+			}
+			if (stat->nSent < stat->cmdLen)
+				return;
+		}
+		stat->nSent = 0;
+		stat->cmdLen = 0;
+		
+		// Skip the uploads that have been sent and are waiting to be saved. Nothing more is sent while a resumed
+		// upload waits for its offset
+		struct STREAM *stream = streamHead;
+		while (stream != NULL && stream->started && stream->nSent == stream->filesize && !stream->waiting)
+			stream = stream->next;
+		if (stream == NULL || stream->waiting || stat->greeting) {
+			peers[i].events &= ~POLLWRNORM;
+			return;
+		}
+		if (!stream->started) {
+			stat->cmdLen = EncodeFrame(stat->cmdSend, FRAMING_V2, stream->resume ? RESUMEF : PUTF, stream->cmd, strlen(stream->cmd));
+			stream->started = 1;
+			stream->waiting = stream->resume;
+			continue;
+		}
+		if (stream->nSent < stream->filesize) {
+			// Read the next chunk of the file straight into the frame, or into a buffer to be compressed from
+			BYTE chunk[PUSH_CHUNK];
+			BYTE *body = stat->cmdSend + FRAME_HDR_LEN + PUSH_ID_LEN;
+			int n = PUSH_CHUNK;
+			if (n > stream->filesize - stream->nSent)
+				n = stream->filesize - stream->nSent;
+			if ((n = read(stream->fileFD, stat->compress ? chunk : body, n)) <= 0) {
+				Log("ERROR: Cannot read file '%s'.", stream->filename);
+				RemoveConnection(i);
+				return;
+			}
+			
+			// A chunk that does not shrink is sent as it is
+			int z = stat->compress ? CompressChunk(chunk, n, body, n - 1) : -1;
+			if (z >= 0) {
+				PutFrameHeader(stat->cmdSend, FILEZ, PUSH_ID_LEN + z);
+				stat->cmdLen = FRAME_HDR_LEN + PUSH_ID_LEN + z;
+			}
+			else {
+				if (stat->compress)
+					memcpy(body, chunk, n);
+				PutFrameHeader(stat->cmdSend, FILEDATA, PUSH_ID_LEN + n);
+				stat->cmdLen = FRAME_HDR_LEN + PUSH_ID_LEN + n;
+			}
+			stat->cmdSend[FRAME_HDR_LEN] = (BYTE)(stream->id >> 24);
+			stat->cmdSend[FRAME_HDR_LEN + 1] = (BYTE)(stream->id >> 16);
+			stat->cmdSend[FRAME_HDR_LEN + 2] = (BYTE)(stream->id >> 8);
+			stat->cmdSend[FRAME_HDR_LEN + 3] = (BYTE)stream->id;
+			stream->nSent += n;
+			continue;
+		}
+	}
+}
+
+// Forget an upload once the server has saved it, or could not save it
+void finishStream(unsigned int id) {
+	struct STREAM *prev = NULL;
+	for (struct STREAM *stream = streamHead; stream != NULL; prev = stream, stream = stream->next) {
+		if (stream->id != id)
+			continue;
+		if (prev != NULL)
+			prev->next = stream->next;
+		else
+			streamHead = stream->next;
+		if (streamTail == stream)
+			streamTail = prev;
+		close(stream->fileFD);
+		free(stream);
+		return;
+	}
+}
+
+// The server holds part of an upload that was resumed. args holds the stream id and the number of bytes it holds,
+// and the rest of the file is sent from there
+void offset(int i, char * args) {
+	unsigned int id;
+	long off;
+	if (sscanf(args, "%u %ld", &id, &off) != 2)
+		return;
+	for (struct STREAM *stream = streamHead; stream != NULL; stream = stream->next) {
+		if (stream->id != id || !stream->waiting)
+			continue;
+		if (off < 0 || off > stream->filesize || lseek(stream->fileFD, off, SEEK_SET) < 0) {
+			Log("ERROR: Cannot resume upload of file '%s' at %ld bytes.", stream->filename, off);
+			return;
+		}
+		Log("INFO: Resuming upload of file '%s' at %ld of %ld bytes.", stream->filename, off, stream->filesize);
+		stream->nSent = off;
+		stream->waiting = 0;
+		peers[i].events |= POLLWRNORM;
+		return;
+	}
+}
+
+// Create a socket connection to send a file to the server
+void createDataSocket(int type, char *cmd) {
+	// Uploads share the data channel when multiplexing
+	if (multiplex) {
+		queueUpload(type, cmd);
+		return;
+	}
+	
+	// Create a non-blocking socket and start connecting it to the server
+	int connecting;
+	int fd = connectServer(&connecting);
 	if (fd != -1) {
-		// If this succeeds, increase number of connections and initialize all info structs
+		// If this succeeds, increase number of connections and initialize all info structs. Nothing is sent
+		// until the connection is up
 		++nConns;
 		peers[nConns].fd = fd;
 		peers[nConns].events = POLLWRNORM | POLLRDNORM;
 		peers[nConns].revents = 0;
 		memset(&connStat[nConns], 0, sizeof(struct CONN_STAT));
+		connStat[nConns].connecting = connecting;
+		connStat[nConns].fileFD = -1;
 		
 		// If command if SENDF, parse command for filename
 		if (type == SENDF) {
@@ -246,36 +604,16 @@ void createDataSocket(int type, char *cmd) {
 			if (connStat[nConns].filename[last-1] = '\n') 
 				connStat[nConns].filename[last-1] = '\0';
 			
-			// Attempt to open the file. If it doesnt exist, remove new connection
-			FILE * file;
-			if ((file = fopen(connStat[nConns].filename, "r")) == NULL) {
-				Log("ERROR: Cannot open file '%s'. Does it exist?", connStat[nConns].filename);
+			// Open the file and find its size. The file is sent straight from disk, so it is never held in memory
+			if ((connStat[nConns].fileFD = openUpload(connStat[nConns].filename, &connStat[nConns].filesize)) < 0) {
 				RemoveConnection(nConns);
 				return;
 			}
 			
-			// Find the size of the file
-			fseek(file, 0, SEEK_END);
-			connStat[nConns].filesize = ftell(file);
-			fseek(file, 0, SEEK_SET);
-			
-			// Allocate memory of the same size as the file and save the file into it
-			connStat[nConns].file = (char *)malloc(sizeof(char) * connStat[nConns].filesize);
-			memset(connStat[nConns].file, 0, connStat[nConns].filesize);
-			
-			// Make sure the correct number of bits has been written into the buffer
-			int n;
-			if ((n = fread(connStat[nConns].file, sizeof(char), connStat[nConns].filesize, file)) != connStat[nConns].filesize) {
-				Log("ERROR: File read incorrectly (%d/%d bytes)", n, connStat[nConns].filesize);
-				RemoveConnection(nConns);
-				return;
-			}
-			
-			// Close the new file as it has been saved into memory
-			fclose(file);
-			
 			// Write a command consisting of the filesize to transmit and the name of the file
-			sprintf(connStat[nConns].cmdSend, "RECVF %s %d %s\n", connStat[0].user, connStat[nConns].filesize, connStat[nConns].filename);
+			char line[CMD_LEN];
+			snprintf(line, CMD_LEN, "RECVF %s %ld %s\n", connStat[0].user, connStat[nConns].filesize, connStat[nConns].filename);
+			SetCommand(nConns, line);
 		}
 		if (type == SENDF2) {
 			char *target = strtok(cmd, " ");
@@ -288,122 +626,204 @@ void createDataSocket(int type, char *cmd) {
 			if (connStat[nConns].filename[last-1] = '\n') 
 				connStat[nConns].filename[last-1] = '\0';
 			
-			// Attempt to open the file. If it doesnt exist, remove new connection
-			FILE * file;
-			if ((file = fopen(connStat[nConns].filename, "r")) == NULL) {
-				Log("ERROR: Cannot open file '%s'. Does it exist?", connStat[nConns].filename);
+			// Open the file and find its size. The file is sent straight from disk, so it is never held in memory
+			if ((connStat[nConns].fileFD = openUpload(connStat[nConns].filename, &connStat[nConns].filesize)) < 0) {
 				RemoveConnection(nConns);
 				return;
 			}
 			
-			// Find the size of the file
-			fseek(file, 0, SEEK_END);
-			connStat[nConns].filesize = ftell(file);
-			fseek(file, 0, SEEK_SET);
-			
-			// If the file is over 10000000 bytes, it cannot be sent
-			if (connStat[nConns].filesize > MAX_REQUEST_SIZE) {
-				Log("ERROR: This file is %d bytes, which is larger than the maximum file size of 10MB.");
-				fclose(file);
-				RemoveConnection(nConns);
-				return;
-			}
-			
-			// Allocate memory of the same size as the file and save the file into it
-			connStat[nConns].file = (char *)malloc(sizeof(char) * connStat[nConns].filesize);
-			memset(connStat[nConns].file, 0, connStat[nConns].filesize);
-			
-			// Make sure the correct number of bytes has been written into the buffer
-			int n;
-			if ((n = fread(connStat[nConns].file, sizeof(char), connStat[nConns].filesize, file)) != connStat[nConns].filesize) {
-				Log("ERROR: File read incorrectly (%d/%d bytes)", n, connStat[nConns].filesize);
-				fclose(file);
-				RemoveConnection(nConns);
-				return;
-			}
-			
-			// Close the new file as it has been saved into memory
-			fclose(file);
-			
 			// Write a command consisting of the filesize to transmit and the name of the file
-			sprintf(connStat[nConns].cmdSend, "RECVF4 %s %s %d %s\n", target, connStat[0].user, connStat[nConns].filesize, connStat[nConns].filename);
+			char line[CMD_LEN];
+			snprintf(line, CMD_LEN, "RECVF4 %s %s %ld %s\n", target, connStat[0].user, connStat[nConns].filesize, connStat[nConns].filename);
+			SetCommand(nConns, line);
 		}
 	}
 }
 
-// Create a socket connection to request a file from the server
-void reqSock (char * reqFile) {	
-	// Create a non-blocking socket and connect it to the server
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	int conn = connect(fd, (const struct sockaddr *) &serverAddr, sizeof(serverAddr));
-	SetNonBlockIO(fd);
+// Create a socket connection to request a file from the server. reqFile holds the body of the LISTEN command.
+// A download that was interrupted is resumed from offset, the number of bytes of the file already received
+void reqSock (char * reqFile, long offset, int retries) {	
+	// Create a non-blocking socket and start connecting it to the server
+	int connecting;
+	int fd = connectServer(&connecting);
 	if (fd != -1) {
-		// If this succeeds, increase number of connections and initialize all info structs
+		// If this succeeds, increase number of connections and initialize all info structs. Nothing is sent
+		// until the connection is up
 		++nConns;
 		peers[nConns].fd = fd;
 		peers[nConns].events = POLLWRNORM | POLLRDNORM;
 		peers[nConns].revents = 0;
 		memset(&connStat[nConns], 0, sizeof(struct CONN_STAT));
+		connStat[nConns].connecting = connecting;
+		connStat[nConns].fileFD = -1;
+		connStat[nConns].retries = retries;
+		snprintf(connStat[nConns].request, CMD_LEN, "%s", reqFile);
 		
-		// Write a command requesting the file from the server
-		sprintf(connStat[nConns].cmdSend, "SENDF %s\n", reqFile);
+		// Write a command requesting the file from the server. A resumed request follows the receiver with the offset
+		char line[CMD_LEN];
+		char sender[9], receiver[9];
+		int pos;
+		if (offset > 0 && sscanf(reqFile, "%8s %8s %n", sender, receiver, &pos) == 2)
+			snprintf(line, CMD_LEN, "SENDF %s %s:%ld %s\n", sender, receiver, offset, reqFile + pos);
+		else
+			snprintf(line, CMD_LEN, "SENDF %s\n", reqFile);
+		SetCommand(nConns, line);
 	}
 }
 
-// Receive a file from the server
+// Receive a file from the server, writing it to disk a chunk at a time as it arrives
 void recvf(int i) {
-	// Receive the file from the server and write it to a new file in the client directory
-	if (connStat[i].nRecv < connStat[i].filesize) {
-		if (Recv_NonBlocking(peers[i].fd, connStat[i].file, connStat[i].filesize, &connStat[i], &peers[i]) < 0) {
-			Log("ERROR: Receive from server failed.");
-			RemoveConnection(i);
-			return;
-		}
-		if (connStat[i].nRecv == connStat[i].filesize) {
-			// Create a new file in write mode with the same filename as the client's copy. Overwrite if file with filename exists already 
-			FILE * newFile;
-			if ((newFile = fopen(connStat[i].filename, "w")) == NULL) {
-				Log("ERROR: Cannot open new file '%s'.", connStat[i].filename);
-				fclose(newFile);
-				free(connStat[i].file);
+	struct CONN_STAT *stat = &connStat[i];
+	char chunk[FILE_CHUNK];
+	
+	// The file could not be created when the transfer started
+	if (stat->fileFD < 0) {
+		RemoveConnection(i);
+		return;
+	}
+	
+	while (stat->fileOff < stat->filesize) {
+		int len = FILE_CHUNK;
+		if (len > stat->filesize - stat->fileOff)
+			len = stat->filesize - stat->fileOff;
+		
+		int n = recv(peers[i].fd, chunk, len, 0);
+		if (n > 0) {
+			if (write(stat->fileFD, chunk, n) != n) {
+				Log("ERROR: Incorrect number of bytes (%ld/%ld) written to file.", stat->fileOff, stat->filesize);
 				RemoveConnection(i);
 				return;
 			}
+			stat->fileOff += n;
+		} else if (n < 0 && errno == EWOULDBLOCK) {
+			//The socket becomes non-readable. OS will notify us when we can read
+			return;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			Log("ERROR: Receive from server failed.");
 			
-			// Write the data received from the server to the new file
-			int n;
-			if ((n = fwrite(connStat[i].file, sizeof(char), connStat[i].filesize, newFile)) < connStat[i].filesize) {
-				Log("ERROR: Incorrect number of bytes (%d/%d) written to file.", n, connStat[i].filesize);
-				fclose(newFile);
-				free(connStat[i].file);
-				RemoveConnection(i);
-				return;
-			}
-			Log("INFO: Successfully received file '%s' (%d bytes).", connStat[i].filename, connStat[i].filesize, connStat[i].user);
-		
-			// Free resources and close the file;
-			fclose(newFile);
-			free(connStat[i].file);
-			connStat[i].nCmdRecv = 0;
-			connStat[i].nRecv = 0;
-
-			// Send terminate command back to the server to finalize file transfer process
-			sprintf(connStat[i].cmdSend, "TERMINATE %s\n", connStat[0].user);
-			if (Send_NonBlocking(peers[i].fd, connStat[i].cmdSend, CMD_LEN, &connStat[i], &peers[i]) < 0) {
-				Log("Command sent incorrectly");
-				RemoveConnection(i);
+			// Ask for the rest of the file over a new connection, keeping what has been received
+			char request[CMD_LEN];
+			long received = stat->fileOff;
+			int retries = stat->retries;
+			snprintf(request, CMD_LEN, "%s", stat->request);
+			RemoveConnection(i);
+			if (retries < TRANSFER_RETRIES && request[0]) {
+				Log("INFO: Resuming download at %ld bytes (attempt %d).", received, retries + 1);
+				reqSock(request, received, retries + 1);
 			}
+			return;
 		}
 	}
+	Log("INFO: Successfully received file '%s' (%ld bytes).", stat->filename, stat->filesize);
+	
+	// Close the file and reset the transfer
+	close(stat->fileFD);
+	stat->fileFD = -1;
+	stat->nCmdRecv = 0;
+	stat->nRecv = 0;
+	
+	// Send terminate command back to the server to finalize file transfer process
+	char line[CMD_LEN];
+	snprintf(line, CMD_LEN, "TERMINATE %s\n", connStat[0].user);
+	SetCommand(i, line);
+	if (Send_NonBlocking(peers[i].fd, stat->cmdSend, stat->cmdLen, stat, &peers[i]) < 0) {
+		Log("Command sent incorrectly");
+		RemoveConnection(i);
+	}
+}
+
+// Start receiving a file the server pushes over the control connection. args holds the id the server gave the
+// file, the sender, the file size and the filename
+void pushf(char * args) {
+	char sender[9];
+	if (pushFile != NULL) {
+		Log("ERROR: File '%s' was only partly received (%ld/%ld bytes).", pushName, pushRecv, pushSize);
+		fclose(pushFile);
+		pushFile = NULL;
+	}
+	if (sscanf(args, "%u %8s %ld %32[^\n]", &pushID, sender, &pushSize, pushName) != 4) {
+		Log("ERROR: Invalid file push '%s' received from server.", args);
+		return;
+	}
+	
+	// Create a new file with the same filename as the sender's copy. Overwrite if file with filename exists already
+	if ((pushFile = fopen(pushName, "w")) == NULL) {
+		Log("ERROR: Cannot open new file '%s'.", pushName);
+		return;
+	}
+	pushRecv = 0;
+	Log("INFO: Receiving file '%s' (%ld bytes) from '%s'.", pushName, pushSize, sender);
+	
+	// An empty file has no chunks to wait for
+	if (pushSize == 0) {
+		fclose(pushFile);
+		pushFile = NULL;
+		Log("INFO: Successfully received file '%s' (%ld bytes).", pushName, pushSize);
+	}
+}
+
+// Write a chunk of the file being pushed by the server to disk
+void recvChunk(int i) {
+	BYTE *data = (BYTE *)connStat[i].args;
+	int len = connStat[i].argsLen - PUSH_ID_LEN;
+	if (len < 0) {
+		Log("ERROR: Invalid file chunk received from server.");
+		return;
+	}
+	
+	// Chunks of a file that could not be created are dropped
+	unsigned int id = ((unsigned int)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+	if (pushFile == NULL || id != pushID)
+		return;
+	
+	if (pushRecv + len > pushSize || fwrite(data + PUSH_ID_LEN, sizeof(char), len, pushFile) != len) {
+		Log("ERROR: Incorrect number of bytes (%ld/%ld) written to file.", pushRecv + len, pushSize);
+		fclose(pushFile);
+		pushFile = NULL;
+		return;
+	}
+	pushRecv += len;
+	
+	if (pushRecv == pushSize) {
+		fclose(pushFile);
+		pushFile = NULL;
+		Log("INFO: Successfully received file '%s' (%ld bytes).", pushName, pushSize);
+	}
+}
+
+// Expand a compressed chunk of a file being pushed by the server in place into the FILEDATA frame it stands for,
+// and write it to disk like one
+void recvCompressedChunk(int i) {
+	BYTE chunk[PUSH_CHUNK];
+	int len = connStat[i].argsLen - PUSH_ID_LEN;
+	int n = (len >= 0) ? DecompressChunk((BYTE *)connStat[i].args + PUSH_ID_LEN, len, chunk, PUSH_CHUNK) : -1;
+	if (n < 0) {
+		Log("ERROR: Invalid compressed file chunk received from server.");
+		return;
+	}
+	memcpy(connStat[i].args + PUSH_ID_LEN, chunk, n);
+	connStat[i].argsLen = PUSH_ID_LEN + n;
+	recvChunk(i);
+}
+
+// The server saved one of the uploads sent over the data channel. args holds the stream id and the file size
+void ackf(char * args) {
+	unsigned int id;
+	long size;
+	if (sscanf(args, "%u %ld", &id, &size) == 2) {
+		Log("INFO: Upload %u (%ld bytes) saved by the server.", id, size);
+		finishStream(id);
+		channelRetries = 0;
+	}
 }
 
 // Choose which actions to take based on which command has been received
-void protocol(char * cmdRecv, int i) {
-	char * command = strtok(cmdRecv, " ");
-	char * message = strtok(NULL, "");
-	int cmd = strToMsg(command);
+void protocol(int i) {
+	char * message = connStat[i].args;
 	
-	switch(cmd) {
+	switch(connStat[i].msg) {
 		case IDLE:
 			break;
 		case LOGIN:
@@ -417,15 +837,46 @@ void protocol(char * cmdRecv, int i) {
 			break;
 		case ERROR:
 			Log("ERROR: %s", message);
+			
+			// On the data channel this means the oldest upload sent could not be saved
+			if (connStat[i].channel && streamHead != NULL && streamHead->started && !streamHead->waiting && streamHead->nSent == streamHead->filesize)
+				finishStream(streamHead->id);
 			break;
 		case LISTEN:
-			reqSock(message);
+			reqSock(message, 0, 0);
 			break;
 		case RECV:
 			recvf(i);
 			break;
+		case HELLO:
+			// The server has confirmed it is using v2 framing. If it did not agree to push files, they are still offered with LISTEN
+			connStat[i].compress = (strstr(message, COMPRESS_CAPABILITY) != NULL);
+			if (connStat[i].greeting) {
+				connStat[i].greeting = 0;
+				peers[i].events |= POLLWRNORM;
+			}
+			if (i == 0 && pushFiles && strstr(message, PUSH_CAPABILITY) == NULL)
+				Log("INFO: Server does not push files, they will be requested with LISTEN.");
+			if (i == 0 && compressFiles && !connStat[i].compress)
+				Log("INFO: Server does not compress files, they will be sent as they are.");
+			break;
+		case PUSHF:
+			pushf(message);
+			break;
+		case ACKF:
+			ackf(message);
+			break;
+		case OFFSET:
+			offset(i, message);
+			break;
+		case FILEDATA:
+			recvChunk(i);
+			break;
+		case FILEZ:
+			recvCompressedChunk(i);
+			break;
 		default:
-			Log("Unknown client command '%s' received from server. Exiting...", command);
+			Log("Unknown client command '%s' received from server. Exiting...", connStat[i].cmdRecv);
 			exit(-1);
 	}
 }
@@ -433,11 +884,48 @@ void protocol(char * cmdRecv, int i) {
 int main(int argc, char *argv[]) {
 	char *line = (char *)malloc(sizeof(char) * CMD_LEN);
 	timestamp = (char *)malloc(sizeof(char) * 11);
-	int n;
+	int n, opt;
+	
+	// Build the command name table before any command is decoded
+	InitMsgTable();
+	
+	// A connection the server drops is noticed through failed sends instead of ending the client, so a lost data
+	// channel can be reopened
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Use v2 framing unless the client has to talk to a server that only knows v1
+	framing = FRAMING_V2;
+	while ((opt = getopt(argc, argv, "v:pmz")) != -1) {
+		if (opt == 'p') {
+			// Files are pushed over the control connection, which needs v2 framing
+			pushFiles = 1;
+		}
+		else if (opt == 'z') {
+			// File chunks are compressed on connections where the server agrees to it, which needs v2 framing
+			compressFiles = 1;
+		}
+		else if (opt == 'm') {
+			// Uploads are multiplexed over one data channel, which also needs v2 framing
+			multiplex = 1;
+		}
+		else if (opt == 'v' && atoi(optarg) == 1) {
+			framing = FRAMING_V1;
+		}
+		else if (opt != 'v' || atoi(optarg) != 2) {
+			Log("Proper usage: './client [-v 1|2] [-p] [-m] [-z] [Server IP Address] [Server Port] [Input Script]'");
+			return -1;
+		}
+	}
+	if ((pushFiles || multiplex || compressFiles) && framing == FRAMING_V1) {
+		Log("Files can only be pushed, multiplexed or compressed with v2 framing. Proper usage: './client [-v 1|2] [-p] [-m] [-z] [Server IP Address] [Server Port] [Input Script]'");
+		return -1;
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
 	
 	// command line arguments must follow form detailed in project outline
 	if (argc < 4) {
-		Log("Incorrect number of arguments. Proper usage: './client [Server IP Address] [Server Port] [Input Script]'");
+		Log("Incorrect number of arguments. Proper usage: './client [-v 1|2] [-p] [-m] [-z] [Server IP Address] [Server Port] [Input Script]'");
 		return -1;
 	}
 	memset(line, 0, CMD_LEN);
@@ -459,6 +947,19 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 	
+	// Announce v2 framing before anything else is sent, along with the capabilities the client wants to use.
+	// The server answers with a HELLO of its own
+	if (framing == FRAMING_V2) {
+		char helloBody[16];
+		snprintf(helloBody, sizeof(helloBody), "2%s%s", pushFiles ? " " PUSH_CAPABILITY : "", compressFiles ? " " COMPRESS_CAPABILITY : "");
+		BYTE hello[FRAME_HDR_LEN + 16];
+		int helloLen = EncodeFrame(hello, FRAMING_V2, HELLO, helloBody, strlen(helloBody));
+		if (send(sock, hello, helloLen, 0) != helloLen) {
+			Log("ERROR: Failed to connect to the server. Closing...");
+			return -1;
+		}
+	}
+	
 	// Set the socket with non-blocking IO
 	SetNonBlockIO(sock);
 	
@@ -487,8 +988,7 @@ int main(int argc, char *argv[]) {
 		Log("ERROR: Initial getline failed. Closing connection.");
 		return -1;
 	}
-	sprintf(connStat[0].cmdSend, "%s", line);
-	connStat[0].msg = cmdToMsg(connStat[0].cmdSend);
+	connStat[0].msg = SetCommand(0, line);
 	
 	// The main loop for carrying out nonblocking operations
 	while (1) {			
@@ -500,26 +1000,23 @@ int main(int argc, char *argv[]) {
 			peers[0].events |= POLLWRNORM;		
 			
 			// Grab the next line from the script and find its command type
-			memset(connStat[0].cmdSend, 0, CMD_LEN);
 			if(getline(&line, &len, input) == -1) {
 				Log("End of script reached, disconnecting from server...");
 				break;
 			}
-			sprintf(connStat[0].cmdSend, "%s", line);
-			connStat[0].msg = cmdToMsg(connStat[0].cmdSend);
+			connStat[0].msg = SetCommand(0, line);
 			
 			// If the next message is a SENDF or SENDF2, create a new data socket to handle transferring the file to the server
 			if (connStat[0].msg == SENDF || connStat[0].msg == SENDF2) {
 				if (connStat[0].loggedIn) {
-					createDataSocket(connStat[0].msg, connStat[0].cmdSend);
+					createDataSocket(connStat[0].msg, line);
 				}
 				else {
 					Log("ERROR: Cannot send file, you are not logged in.");
 				}
 					
 				// Change the command sent to the server from the message socket (socket 0 on client side) to IDLE
-				memset(connStat[0].cmdSend, 0, CMD_LEN);
-				sprintf(connStat[0].cmdSend, "IDLE");
+				SetCommand(0, "IDLE");
 				connStat[0].msg = 0;
 				continue;
 			}
@@ -539,10 +1036,21 @@ int main(int argc, char *argv[]) {
 		
 		// For all data sockets, check what event has occured and on which socket
 		for (int i=0; i<=nConns; i++) {
+			// A data socket that is still connecting becomes writable once its connection is up, or reports an error
+			if (connStat[i].connecting) {
+				if (!(peers[i].revents & (POLLWRNORM | POLLERR | POLLHUP)))
+					continue;
+				if (finishConnect(i) < 0) {
+					RemoveConnection(i);
+					continue;
+				}
+			}
+			
 			// A socket is requesting to receive data
 			if (peers[i].revents & (POLLRDNORM | POLLERR | POLLHUP)) {
-				if (connStat[i].nCmdRecv < CMD_LEN) {
-					if (Recv_NonBlocking(peers[i].fd, connStat[i].cmdRecv, CMD_LEN, &connStat[i], &peers[i]) < 0) {
+				if (connStat[i].nCmdRecv == 0) {
+					int rc = RecvFrame(i);
+					if (rc < 0) {
 						// If the connection has been closed from the server side, close the client gracefully
 						if (i == 0) {
 							Log("Connection lost with server, shutting down.");
@@ -559,27 +1067,30 @@ int main(int argc, char *argv[]) {
 						}
 						RemoveConnection(i);
 					}
-					if (connStat[i].nRecv == CMD_LEN) {
-						connStat[i].nRecv = 0;
-						
+					if (rc > 0) {
 						// All sockets receive commands back from the server, not messages
-						if (i > 0) {
-							// Any socket on the client size with i>0 is a file transfer helper
+						if (i > 0 && !connStat[i].channel && connStat[i].msg == RECV) {
+							// Any other socket on the client size with i>0 is a file transfer helper. Anything other than RECV,
+							// like an ERROR refusing an upload, is handled by protocol() below
 							// Parse through the command returned by the server to retrieve the filename and filesize that will be sent next
-							connStat[i].nCmdRecv = CMD_LEN;
-							char * filesize = strtok(connStat[i].cmdRecv, " ");
-							filesize = strtok(NULL, " ");
+							connStat[i].nCmdRecv = 1;
+							char * filesize = strtok(connStat[i].args, " ");
 							char * filename = strtok(NULL, "");
+							char * offset = strchr(filesize, ':');
 							sprintf(connStat[i].filename, "%s", filename);
-							connStat[i].filesize = atoi(filesize);
+							connStat[i].filesize = atol(filesize);
 							
-							// Allocate memory for the file being sent
-							connStat[i].file = (char *)malloc(sizeof(char) * connStat[i].filesize);
-							memset(connStat[i].file, 0, connStat[i].filesize);
+							// Create the file being sent. It is written to disk as it arrives, so memory used does not depend on its size.
+							// A resumed download keeps the part of the file received before, and the server sends the rest
+							connStat[i].fileOff = (offset != NULL) ? atol(offset + 1) : 0;
+							if ((connStat[i].fileFD = open(connStat[i].filename, O_WRONLY | O_CREAT | (offset != NULL ? 0 : O_TRUNC), 0644)) < 0)
+								Log("ERROR: Cannot open new file '%s'.", connStat[i].filename);
+							else if (offset != NULL && (ftruncate(connStat[i].fileFD, connStat[i].fileOff) != 0 || lseek(connStat[i].fileFD, connStat[i].fileOff, SEEK_SET) < 0))
+								Log("ERROR: Cannot resume file '%s' at %ld bytes.", connStat[i].filename, (long)connStat[i].fileOff);
 						}
 						
 						// Act on the command received from the server
-						protocol(connStat[i].cmdRecv, i);
+						protocol(i);
 						
 						// If the input script has finished, and the socket is not a file helper, go to the end to close the client gracefully
 						if (eof && !i) {
@@ -597,16 +1108,17 @@ int main(int argc, char *argv[]) {
 				}
 				
 				// Act based on the command received from the server
-				if (connStat[i].nCmdRecv == CMD_LEN) {
-					protocol(connStat[i].cmdRecv, i);
+				if (connStat[i].nCmdRecv) {
+					protocol(i);
 				}
 			}
 			
-			// A socket is requesting to send data
-			if (peers[i].revents & POLLWRNORM) {
+			// A socket is requesting to send data. Removing a connection above moves the next one into slot i, and
+			// that one may still be connecting
+			if ((peers[i].revents & POLLWRNORM) && !connStat[i].connecting) {
 				// The command socket (socket 0) will only ever send commands
-				if (connStat[i].nSent < CMD_LEN && (i == 0)) {
-					if (Send_NonBlocking(sock, connStat[i].cmdSend, CMD_LEN, &connStat[i], &peers[i]) < 0) {
+				if (connStat[i].nSent < connStat[i].cmdLen && (i == 0)) {
+					if (Send_NonBlocking(sock, connStat[i].cmdSend, connStat[i].cmdLen, &connStat[i], &peers[i]) < 0) {
 						if (i == 0) {
 							Log("Connection lost with server, shutting down.");
 							
@@ -623,33 +1135,30 @@ int main(int argc, char *argv[]) {
 						RemoveConnection(i);
 					}
 					
-					if (connStat[i].nSent == CMD_LEN) {
+					if (connStat[i].nSent == connStat[i].cmdLen) {
 						connStat[i].nSent = 0;	
 						
 						// Allow for writing again on the socket
 						peers[i].events |= POLLWRNORM;
 						
 						// Grab the next line from the script and find its command type
-						memset(connStat[i].cmdSend, 0, CMD_LEN);
 						if(getline(&line, &len, input) == -1) {
 							Log("End of script reached, disconnecting from server...");
 							eof = 1;
 						}
-						sprintf(connStat[i].cmdSend, "%s", line);
-						connStat[i].msg = cmdToMsg(connStat[i].cmdSend);
+						connStat[i].msg = SetCommand(i, line);
 						
 						// If the next message is a SENDF or SENDF2, create a new data socket to handle transferring the file to the server
 						if (connStat[0].msg == SENDF || connStat[0].msg == SENDF2) {
 							if (connStat[i].loggedIn) {
-								createDataSocket(connStat[0].msg, connStat[0].cmdSend);
+								createDataSocket(connStat[0].msg, line);
 							}
 							else {
 								Log("ERROR: Cannot send file, you are not logged in.");
 							}
 					
 							// Change the command sent to the server from the message socket (socket 0 on client side) to IDLE
-							memset(connStat[0].cmdSend, 0, CMD_LEN);
-							sprintf(connStat[0].cmdSend, "IDLE");
+							SetCommand(0, "IDLE");
 							connStat[0].msg = 0;
 							continue;
 						}
@@ -670,31 +1179,35 @@ int main(int argc, char *argv[]) {
 					}
 				}
 				
+				// The data channel sends one upload after another
+				else if (i > 0 && connStat[i].channel) {
+					sendStreams(i);
+				}
+				
 				// The data sockets will send both a command (RECVF/RECVF2) and a file
 				else if (i > 0) {
 					// Send command
-					if (connStat[i].nStatSent < CMD_LEN) {
-						if (Send_NonBlocking(peers[i].fd, connStat[i].cmdSend, CMD_LEN, &connStat[i], &peers[i]) < 0) {
+					if (connStat[i].nStatSent < connStat[i].cmdLen) {
+						if (Send_NonBlocking(peers[i].fd, connStat[i].cmdSend, connStat[i].cmdLen, &connStat[i], &peers[i]) < 0) {
 							Log("Command sent incorrectly.");
 							RemoveConnection(i);
 						}
-						if (connStat[i].nSent == CMD_LEN) {
-							connStat[i].nStatSent = CMD_LEN;
+						if (connStat[i].nSent == connStat[i].cmdLen) {
+							connStat[i].nStatSent = connStat[i].cmdLen;
 							connStat[i].nSent = 0;
 						}
 					}
 					
 					// Send file
-					if (connStat[i].nStatSent == CMD_LEN && connStat[i].nSent < connStat[i].filesize) {
-						if (Send_NonBlocking(peers[i].fd, connStat[i].file, connStat[i].filesize, &connStat[i], &peers[i]) < 0) {
+					if (connStat[i].nStatSent == connStat[i].cmdLen && connStat[i].fileOff < connStat[i].filesize) {
+						if (sendFile(i) < 0) {
 							Log("File sent incorrectly.");
 							RemoveConnection(i);
 						}
-						if (connStat[i].nSent == connStat[i].filesize) {
-							// File has been sent, it is safe to free memory used by file
-							free(connStat[i].file);
-							connStat[i].nStatSent = 0;
-							connStat[i].nSent = 0;
+						else if (connStat[i].fileOff == connStat[i].filesize) {
+							// File has been sent, it can be closed
+							close(connStat[i].fileFD);
+							connStat[i].fileFD = -1;
 						}
 					}
 				}
@@ -0,0 +1,334 @@
+// Wire protocol shared by the GopherChat client and server
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string.h>
+#include <stdint.h>
+
+typedef unsigned char BYTE;
+
+// v1 framing: every command is sent as a zero-padded frame of exactly CMD_LEN bytes
+#define CMD_LEN 300
+
+// v2 framing: every command is a FRAME_HDR_LEN byte header followed by a body of the length given in the header.
+// The header holds PROTO_MAGIC, the message type, and the body length (big endian). PROTO_MAGIC is not a
+// printable character, so the first byte a peer sends tells v1 and v2 framing apart without a round trip
+#define PROTO_MAGIC 0xC2
+#define FRAME_HDR_LEN 4
+#define MAX_BODY_LEN 65535
+
+// Framing used on a connection
+typedef enum {
+	FRAMING_UNKNOWN,
+	FRAMING_V1,
+	FRAMING_V2
+} framing_type;
+
+// Every command that is sent between the client and server. The values are sent as the message
+// type of v2 frames, so new commands must only ever be added to the end
+typedef enum {
+	IDLE,
+	REGISTER,
+	LOGIN,
+	LOGOUT,
+	SEND,
+	SEND2,
+	SENDA,
+	SENDA2,
+	SENDF,
+	SENDF2,
+	LIST,
+	DELAY,
+	RECVF,
+	RECVF4,
+	TERMINATE,
+	PRINT,
+	ERROR,
+	LISTEN,
+	RECV,
+	HELLO,
+	PUSHF,
+	FILEDATA,
+	PUTF,
+	ACKF,
+	RESUMEF,
+	OFFSET,
+	FILEZ,
+	JOIN,
+	PART,
+	SENDC,
+	NUM_MSG_TYPES
+} msg_type;
+
+// The command names used by v1 framing, indexed by msg_type. Commands that never carry a body are
+// sent with their trailing newline, which is how they appear in the input scripts
+static const char * const msgNames[NUM_MSG_TYPES] = {
+	"IDLE",
+	"REGISTER",
+	"LOGIN",
+	"LOGOUT\n",
+	"SEND",
+	"SEND2",
+	"SENDA",
+	"SENDA2",
+	"SENDF",
+	"SENDF2",
+	"LIST\n",
+	"DELAY",
+	"RECVF",
+	"RECVF4",
+	"TERMINATE",
+	"PRINT",
+	"ERROR",
+	"LISTEN",
+	"RECV",
+	"HELLO",
+	"PUSHF",
+	"FILEDATA",
+	"PUTF",
+	"ACKF",
+	"RESUMEF",
+	"OFFSET",
+	"FILEZ",
+	"JOIN",
+	"PART",
+	"SENDC"
+};
+
+// Command names are looked up in an open addressing hash table built from msgNames, so decoding a v1 command costs
+// one hash and usually one comparison however many commands there are. Each slot holds a msg_type plus one (0 if
+// the slot is empty). InitMsgTable() must run once at startup, before anything is decoded
+#define MSG_TABLE_SIZE 64 // A power of two well above NUM_MSG_TYPES, so probe sequences stay short
+static signed char msgTable[MSG_TABLE_SIZE];
+static unsigned char msgNameLen[NUM_MSG_TYPES];
+
+// FNV-1a hash of a command name
+static inline unsigned int HashMsgName(const char * name, int len) {
+	unsigned int h = 2166136261u;
+	for (int k = 0; k < len; k++)
+		h = (h ^ (unsigned char)name[k]) * 16777619u;
+	return h;
+}
+
+// Fills the command name table from msgNames
+static inline void InitMsgTable(void) {
+	for (int type = 0; type < NUM_MSG_TYPES; type++) {
+		msgNameLen[type] = strlen(msgNames[type]);
+		unsigned int slot = HashMsgName(msgNames[type], msgNameLen[type]) & (MSG_TABLE_SIZE - 1);
+		while (msgTable[slot] != 0)
+			slot = (slot + 1) & (MSG_TABLE_SIZE - 1);
+		msgTable[slot] = type + 1;
+	}
+}
+
+// Returns the command with the given name, which need not be null terminated, or -1 if there is no such command
+static inline int MsgFromName(const char * name, int len) {
+	unsigned int slot = HashMsgName(name, len) & (MSG_TABLE_SIZE - 1);
+	for (int e; (e = msgTable[slot]) != 0; slot = (slot + 1) & (MSG_TABLE_SIZE - 1)) {
+		if (msgNameLen[e - 1] == len && !memcmp(msgNames[e - 1], name, len))
+			return e - 1;
+	}
+	return -1;
+}
+
+// Files can be pushed to v2 clients that ask for it in their HELLO, instead of being offered with LISTEN. A PUSHF
+// command ("<id> <sender> <size> <filename>") starts each pushed file, and its contents follow in FILEDATA frames
+// that may be interleaved with other commands. A FILEDATA body is the file's id (PUSH_ID_LEN bytes, big endian)
+// followed by at most PUSH_CHUNK bytes of the file
+#define PUSH_CAPABILITY "push"
+#define PUSH_ID_LEN 4
+#define PUSH_CHUNK 16384
+
+// v2 clients can also upload files over one long-lived data channel instead of a new connection per file. Each upload
+// is a stream that starts with a PUTF command ("<id> <sender> <receiver> <size> <filename>", with * as the receiver
+// to send the file to every user), followed by FILEDATA frames carrying the stream id. Streams on a channel follow
+// each other, and the server answers ACKF ("<id> <size>") once each file has been saved
+//
+// An upload whose PUTF id is followed by ":<transfer id>" (up to XFER_LEN lowercase hex digits that the client picks
+// for the file) can be resumed. If its channel drops, the server keeps what it has written, and the client later sends
+// RESUMEF with the same body as the PUTF. The server answers OFFSET ("<id> <bytes>") with how much of the file it
+// already holds, and the client sends FILEDATA from that offset on. A download is resumed the same way, by following
+// the receiver in SENDF with ":<bytes already received>". The server then answers with RECV "<size>:<offset> <filename>"
+// and sends only the bytes from offset on
+#define XFER_LEN 16
+
+// A v2 connection whose HELLO lists COMPRESS_CAPABILITY, and whose peer agrees in its own HELLO, may send any FILEDATA
+// frame as FILEZ instead. The body is the same id followed by the chunk compressed with CompressChunk(). Each chunk
+// is compressed on its own, and a chunk that does not shrink (such as part of an image or an archive) is sent as
+// FILEDATA, so files that are already compressed cost nothing extra
+#define COMPRESS_CAPABILITY "lz"
+#define LZ_HASH_BITS 12 // Size of the table of recent positions CompressChunk() looks for matches in
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // A chunk always ends with at least this many literal bytes
+
+// Logged in users can join named channels with JOIN "<channel>" and leave them with PART "<channel>". SENDC
+// "<channel> <message>" sends a message to the members of a channel only, who receive it as PRINT
+// "[#<channel>] <sender>: <message>". Channel names are up to MAX_CHANNEL_NAME letters, digits, '-' or '_', and may be
+// written with a leading '#'. Like the other commands added after TERMINATE, channels need v2 framing
+#define MAX_CHANNEL_NAME 16
+
+// Writes a v2 frame header for a message of the given type and body length
+static inline void PutFrameHeader(BYTE * buf, int type, int len) {
+	buf[0] = PROTO_MAGIC;
+	buf[1] = (BYTE)type;
+	buf[2] = (BYTE)(len >> 8);
+	buf[3] = (BYTE)len;
+}
+
+// Reads a v2 frame header. Returns -1 if the header is not a valid v2 header
+static inline int GetFrameHeader(const BYTE * buf, int * type, int * len) {
+	if (buf[0] != PROTO_MAGIC || buf[1] >= NUM_MSG_TYPES)
+		return -1;
+	*type = buf[1];
+	*len = (buf[2] << 8) | buf[3];
+	return 0;
+}
+
+// Encodes a command into out using the given framing and returns the number of bytes to send.
+// out must hold at least CMD_LEN bytes for v1, or FRAME_HDR_LEN + MAX_BODY_LEN bytes for v2.
+// v1 frames that do not fit in CMD_LEN bytes are truncated
+static inline int EncodeFrame(BYTE * out, framing_type framing, int type, const char * body, int len) {
+	if (len > MAX_BODY_LEN)
+		len = MAX_BODY_LEN;
+
+	if (framing == FRAMING_V2) {
+		PutFrameHeader(out, type, len);
+		memcpy(out + FRAME_HDR_LEN, body, len);
+		return FRAME_HDR_LEN + len;
+	}
+
+	// v1 frames are text commands with the body separated from the name by a space, padded with zeros
+	int nameLen = strlen(msgNames[type]);
+	memset(out, 0, CMD_LEN);
+	memcpy(out, msgNames[type], nameLen);
+	if (len > 0 && nameLen + 1 < CMD_LEN) {
+		out[nameLen] = ' ';
+		if (len > CMD_LEN - nameLen - 2)
+			len = CMD_LEN - nameLen - 2;
+		memcpy(out + nameLen + 1, body, len);
+	}
+	return CMD_LEN;
+}
+
+// Adds a run length that does not fit in a token as a series of bytes, each 255 except the last
+static inline int PutRunLength(BYTE * out, int len) {
+	int n = 0;
+	for (; len >= 255; len -= 255)
+		out[n++] = 255;
+	out[n++] = (BYTE)len;
+	return n;
+}
+
+// Compresses len bytes of in into out in the LZ4 block format: a series of sequences, each a token (literal count in
+// the high four bits, match length minus LZ_MIN_MATCH in the low four), the literal bytes, and a two byte little
+// endian offset back to the match. Returns the compressed length, or -1 if it would take more than cap bytes
+static inline int CompressChunk(const BYTE * in, int len, BYTE * out, int cap) {
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0, anchor = 0, op = 0;
+	memset(table, 0, sizeof(table));
+	
+	while (ip + LZ_MIN_MATCH + LZ_LAST_LITERALS < len) {
+		uint32_t seq, ref;
+		memcpy(&seq, in + ip, 4);
+		int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int cand = table[h];
+		table[h] = ip;
+		memcpy(&ref, in + cand, 4);
+		if (cand >= ip || ip - cand > 65535 || ref != seq) {
+			ip++;
+			continue;
+		}
+		
+		int match = LZ_MIN_MATCH;
+		while (ip + match < len - LZ_LAST_LITERALS && in[cand + match] == in[ip + match])
+			match++;
+		
+		// Worst case for the sequence: token, literal run, literals, offset and match run
+		int lit = ip - anchor;
+		if (op + 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1 > cap)
+			return -1;
+		BYTE * token = out + op++;
+		*token = (BYTE)((lit >= 15 ? 15 : lit) << 4);
+		if (lit >= 15)
+			op += PutRunLength(out + op, lit - 15);
+		memcpy(out + op, in + anchor, lit);
+		op += lit;
+		out[op++] = (BYTE)(ip - cand);
+		out[op++] = (BYTE)((ip - cand) >> 8);
+		match -= LZ_MIN_MATCH;
+		*token |= (match >= 15) ? 15 : match;
+		if (match >= 15)
+			op += PutRunLength(out + op, match - 15);
+		
+		ip += match + LZ_MIN_MATCH;
+		anchor = ip;
+	}
+	
+	// The last sequence is only literals
+	int lit = len - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > cap)
+		return -1;
+	out[op++] = (BYTE)((lit >= 15 ? 15 : lit) << 4);
+	if (lit >= 15)
+		op += PutRunLength(out + op, lit - 15);
+	memcpy(out + op, in + anchor, lit);
+	return op + lit;
+}
+
+// Reads a run length that did not fit in a token. Returns -1 if the run goes past the end of the input
+static inline int GetRunLength(const BYTE * in, int len, int * ip) {
+	int run = 0, b;
+	do {
+		if (*ip >= len)
+			return -1;
+		b = in[(*ip)++];
+		run += b;
+	} while (b == 255);
+	return run;
+}
+
+// Expands len bytes compressed with CompressChunk() into out. The input comes from the network, so every length
+// and offset is checked. Returns the expanded length, or -1 if the input is invalid or would take more than cap bytes
+static inline int DecompressChunk(const BYTE * in, int len, BYTE * out, int cap) {
+	int ip = 0, op = 0;
+	while (ip < len) {
+		int token = in[ip++];
+		int lit = token >> 4;
+		if (lit == 15) {
+			int run = GetRunLength(in, len, &ip);
+			if (run < 0)
+				return -1;
+			lit += run;
+		}
+		if (lit > len - ip || lit > cap - op)
+			return -1;
+		memcpy(out + op, in + ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == len)
+			break;
+		
+		if (len - ip < 2)
+			return -1;
+		int off = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		int match = token & 15;
+		if (match == 15) {
+			int run = GetRunLength(in, len, &ip);
+			if (run < 0)
+				return -1;
+			match += run;
+		}
+		match += LZ_MIN_MATCH;
+		if (off == 0 || off > op || match > cap - op)
+			return -1;
+		
+		// Matches may overlap what they copy, so they are copied a byte at a time
+		for (int k = 0; k < match; k++)
+			out[op + k] = out[op - off + k];
+		op += match;
+	}
+	return op;
+}
+
+#endif
@@ -1,6 +1,8 @@
 //Non-blocking server
+#define _GNU_SOURCE // for MAP_POPULATE and asprintf()
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,795 +16,2559 @@
 #include <poll.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "protocol.h"
 
-typedef unsigned char BYTE;
-
-#define MAX_REQUEST_SIZE 10000000
-#define CMD_LEN 300
-#define MAX_CONCURRENCY_LIMIT 18
+#define MAX_REQUEST_SIZE (16L * 1024 * 1024 * 1024) // Largest file that can be uploaded
+#define MAX_CONCURRENCY_LIMIT 18 // Default connection limit, can be changed at startup with -c
+#define MAX_REACTORS 256 // Most event loop threads that can be started with -t
+#define IO_THREADS 4 // Default number of disk I/O threads, can be changed at startup with -w
+#define LISTEN_SLOT 0 // Connection slot of a reactor's listening socket
+#define MAILBOX_SLOT 1 // Connection slot of a reactor's mailbox eventfd
+#define FIRST_SLOT 2 // First connection slot used by a client
+#define MAX_EVENTS 1024
+#define SEND_BATCH 256 // Most queued frames handed to a single writev() call
+#define MAX_SEND_QUEUE 16384 // Most frames a client may have waiting before it is disconnected
 #define MAX_FILENAME 32
+#define FILE_CHUNK 65536 // Size of the buffer an uploaded file passes through on its way to disk
+#define FILE_CACHE_LIMIT (256 * 1024 * 1024) // Most bytes of files kept in the file cache
+#define FILE_CACHE_FILES 256 // Most files kept in the file cache
+#define MAX_FIELDS 8 // Most fields the arguments of a command are split into
 #define MIN_CRED 4
 #define MAX_CRED 8
+#define ACCOUNT_FILE "registered_accounts.txt"
+#define STORE_DIR "store" // Directory holding one copy of each uploaded file, named by the SHA-256 hash of its contents
+#define HASH_LEN 32 // Bytes in a SHA-256 hash
+#define MAX_CHANNELS 1024 // Most channels the server holds. A channel stays once it has been created, even when it empties
+#define MAX_JOINED 16 // Most channels a user can be in at once
+#define LOG_SLOTS 4096 // Log lines that can be waiting to be written before new ones are dropped (a power of two)
+#define LOG_LINE 1024 // Longest log line, longer ones are cut short
+#define LOG_BATCH 65536 // Most bytes of log lines handed to a single write()
+#define LOG_IDLE_MS 10 // How long the log thread sleeps when no lines are waiting
+#define LATENCY_SUB_BITS 3 // Each power of two of a latency histogram is split into 2^LATENCY_SUB_BITS buckets (within 12.5%)
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 36 // Latencies are kept in microseconds, and anything from 2^36 us (19 hours) up shares the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
 
-// These macros define the commands that are sent/received by the server
-typedef enum {
-	IDLE,
-	REGISTER,
-	LOGIN,
-	LOGOUT,
-	SEND,
-	SEND2,
-	SENDA,
-	SENDA2,
-	SENDF,
-	SENDF2,
-	LIST,
-	DELAY,
-	RECVF,
-	RECVF4,
-	TERMINATE
-} msg_type;
+// Log levels, lines above the current level are skipped before they are formatted
+typedef enum { LOG_ERROR, LOG_INFO, LOG_DEBUG } log_level;
+
+// A line in the log ring. seq says whose turn the slot is: it equals the position being claimed when a producer may fill
+// the slot, and that position plus one once the line is ready for the log thread
+struct LOG_SLOT {
+	unsigned long seq;
+	time_t when;
+	int len;
+	char text[LOG_LINE];
+};
+
+// A block of data waiting in a connection's outbound queue. A broadcast frame is shared by the queue of every user
+// it goes to, possibly on several reactors, and refs counts the queues (and mail) still holding it
+struct FRAME {
+	int len;
+	int refs;
+	char data[];
+};
+
+// The arguments of a received command, split into fields in place in the receive buffer. Each field is a view of
+// the buffer (where it starts and how long it is), and is null terminated where it ends
+struct FIELDS {
+	int n;
+	char * at[MAX_FIELDS];
+	int len[MAX_FIELDS];
+};
 
 // This structure holds all of the information a socket needs to keep track of
 struct CONN_STAT {
 	int msg;
 	int nRecv;
 	int nCmdRecv;
-	int nToRecv;
-	int nSent;
-	int nCmdSent;
-	int nToSend;
+	off_t nToRecv;
+	off_t nToSend;
 	int ID;
 	int loggedIn;
-	int isFileRequest;
-	char * file;
+	int isFileRequest; // Set while a file is being sent to the client
+	struct CACHED_FILE * sendFile; // File being sent to the client with sendfile(), shared with other downloads through the file cache
+	off_t sendOff; // Bytes of the file that have been sent
+	int nAhead; // Frames queued before the file that have to be sent ahead of it
+	int push; // Set when the client asked for files to be pushed over this connection instead of being offered with LISTEN
+	int compress; // Set when file chunks sent either way on this connection may be compressed
+	struct PUSH * pushHead; // Files waiting to be pushed to the client, the one being sent first
+	struct PUSH * pushTail;
+	off_t pushOff; // Bytes of the first file in pushHead that have been queued
+	unsigned int pushID; // Id given to the last file pushed to the client
+	char * file; // Holds the part of an upload that has not been written to disk yet (FILE_CHUNK bytes, NULL when no upload is in progress)
+	char * spare; // Second upload buffer, free to be received into while the other one is being written
+	int nFile; // Bytes waiting in file
+	int fileFD; // Partial file the upload is being written to (-1 until the I/O threads have created it)
+	off_t fileOff; // Bytes of the upload handed to the I/O threads
+	int ioBusy; // Set while a disk operation for this connection is in flight
+	int committing; // Set once the finished upload has been handed over to be moved to its final name
 	char filename[MAX_FILENAME];
-	char user[MAX_CRED];
-	char fileUser[MAX_CRED];
-	char fileRecip[MAX_CRED];
-	char dataRecv[CMD_LEN];
-	char dataSend[CMD_LEN];
+	char user[MAX_CRED + 1];
+	char fileUser[MAX_CRED + 1];
+	char fileRecip[MAX_CRED + 1]; // Receiver of a RECVF4 upload (empty for RECVF uploads)
+	int channel; // Set on a data channel, which carries one upload after another as PUTF streams instead of a single file
+	unsigned int streamID; // Id the client gave the upload in progress on a data channel
+	char xfer[XFER_LEN + 1]; // Transfer id of the upload in progress on a data channel, if it can be resumed
+	int nChunk; // Bytes of the FILEDATA frame being handled that have been copied into the upload buffer
+	framing_type framing; // Framing the client uses, decided by the first byte it sends
+	char * dataRecv; // Holds the command being received (a whole v1 frame, or a v2 header and body)
+	int recvCap; // Bytes allocated for dataRecv
+	char * args; // Arguments of the last command received, inside dataRecv
+	struct FIELDS fields; // args split into fields, once when the command arrives
+	struct CHANNEL * joined[MAX_JOINED]; // Channels the user is in
+	int nJoined;
+	struct FRAME ** sendQueue; // Ring of frames waiting to be sent, oldest first
+	int qHead; // Index of the oldest frame in sendQueue
+	int qLen; // Number of frames in sendQueue
+	int qCap; // Number of entries allocated in sendQueue
+	int qSent; // Bytes of the oldest frame that have already been sent
+	int flushPending; // Set while the connection is in the pending flush list
+	int closing; // Set once a send has failed and the connection is waiting to be closed
+	long bytesIn; // Bytes received from the client
+	long bytesOut; // Bytes sent to the client
+	int replyType; // Command whose reply is waiting in the send queue, timed until the queue empties
+	uint64_t replyStart; // When that command arrived, in nanoseconds (0 when no reply is being timed)
+	unsigned int gen;
+	int nextFree;
 };
 
-// converting string (from script) to enumerated command
-msg_type strToMsg (char *msg) {
-	if (!strcmp(msg, "IDLE"))
-		return IDLE;
-	else if (!strcmp(msg, "REGISTER"))
-		return REGISTER;
-	else if (!strcmp(msg, "LOGIN"))
-		return LOGIN;
-	else if (!strcmp(msg, "LOGOUT\n"))
-		return LOGOUT;
-	else if (!strcmp(msg, "SEND"))
-		return SEND;
-	else if (!strcmp(msg, "SEND2"))
-		return SEND2;
-	else if (!strcmp(msg, "SENDA"))
-		return SENDA;
-	else if (!strcmp(msg, "SENDA2"))
-		return SENDA2;
-	else if (!strcmp(msg, "SENDF"))
-		return SENDF;
-	else if (!strcmp(msg, "SENDF2"))
-		return SENDF2;
-	else if (!strcmp(msg, "LIST\n"))
-		return LIST;
-	else if (!strcmp(msg, "DELAY"))
-		return DELAY;
-	else if (!strcmp(msg, "RECVF"))
-		return RECVF;
-	else if (!strcmp(msg, "RECVF4"))
-		return RECVF4;
-	else if (!strcmp(msg, "TERMINATE"))
-		return TERMINATE;
-	else
-		return -1;
-}
+// Identifies a connection by the reactor that owns it, its slot and the generation of that slot, so a handle
+// to a closed connection is never mistaken for a newer connection reusing the slot
+typedef uint64_t conn_handle;
+#define HANDLE(i) (((conn_handle)connStat[i].gen << 32) | ((conn_handle)reactorID << 24) | (conn_handle)(i))
+#define HANDLE_REACTOR(h) ((int)(((h) >> 24) & 0xff))
+#define HANDLE_SLOT(h) ((int)((h) & 0xffffff))
+
+// A logged in user in the online user index. Empty entries have an empty username
+struct ONLINE_USER {
+	char user[MAX_CRED + 1];
+	conn_handle handle;
+	int ID; // ID of the connection the user is logged in on, which orders the list of online users
+};
+
+// A registered account. Empty entries of the account table have an empty username
+struct ACCOUNT {
+	char user[MAX_CRED + 1];
+	char pass[MAX_CRED + 1];
+};
+
+// Backends the server can use to wait for socket events
+typedef enum {
+	ENGINE_EPOLL,
+	ENGINE_POLL
+} engine_type;
+
+// A socket reported as ready by the event backend
+struct EVENT {
+	conn_handle handle;
+	short revents;
+};
+
+// Kinds of messages reactors post to each other
+typedef enum {
+	MAIL_CMD, // Send a command to one connection
+	MAIL_BROADCAST, // Send a shared frame to every user logged in on the reactor
+	MAIL_CHANNEL, // Send a shared frame to the members of a channel logged in on the reactor
+	MAIL_FILE, // Offer an uploaded file to one connection, or to every user logged in on the reactor apart from the sender
+	MAIL_IO // A disk operation submitted by the reactor has finished
+} mail_type;
+
+// A message posted to another reactor's mailbox. For MAIL_FILE the body holds the sender and the filename, and
+// handle is the connection the file is offered to, or 0 to offer it to every user. For MAIL_CHANNEL the body holds
+// the handles of the channel's members (the fields are laid out so the body is 8-byte aligned)
+struct MAIL {
+	struct MAIL * next;
+	mail_type kind;
+	conn_handle handle;
+	int type;
+	int len;
+	struct IO_JOB * job; // The finished disk operation, for MAIL_IO
+	struct FRAME * frames[2]; // The v1 and v2 encodings of a broadcast, for MAIL_BROADCAST and MAIL_CHANNEL. The mail holds a reference to each
+	char body[];
+};
+
+// Disk operations carried out by the I/O threads, so a slow disk never holds up an event loop
+typedef enum {
+	IO_CREATE, // Create the partial file of an upload
+	IO_WRITE, // Write a chunk of an upload
+	IO_COMMIT, // Close a finished upload and move it to its final name
+	IO_ABORT, // Close and delete the partial file of a failed upload
+	IO_OPEN, // Load a file to be downloaded into the file cache
+	IO_APPEND // Append a line to the accounts file
+} io_type;
+
+// A disk operation waiting for or being handled by an I/O thread. Once it is done it is posted back to the
+// mailbox of the reactor that submitted it, apart from IO_ABORT and IO_APPEND, which nothing waits for
+struct IO_JOB {
+	struct IO_JOB * next;
+	io_type type;
+	int reactor;
+	conn_handle handle; // Connection the operation was submitted for
+	int fd;
+	char * buf;
+	int len;
+	off_t off; // Where a chunk is written
+	struct CACHED_FILE * cached; // The file loaded by IO_OPEN
+	int err; // errno of a failed operation, or 0
+	int msg; // RECVF or RECVF4, for announcing a committed upload
+	int resume; // For IO_CREATE, keep what an earlier attempt of the upload wrote and return its length in off
+	int duplicate; // Set by IO_COMMIT when the store already held a file with the same contents
+	char xfer[XFER_LEN + 1]; // Transfer id of a resumable upload, which names its partial file (empty if it cannot be resumed)
+	char user[MAX_CRED + 1]; // Sender of the file
+	char recip[MAX_CRED + 1]; // Receiver of the file, for RECVF4 uploads and downloads
+	char filename[MAX_FILENAME];
+};
+
+// Counters kept by a reactor about its own connections. Only the reactor adds to them (except mailQueued, which
+// every thread posting mail adds to), and the stats thread reads them all to report on the whole server
+struct STATS {
+	unsigned long cmds[NUM_MSG_TYPES]; // Commands received of each type
+	unsigned long latency[NUM_MSG_TYPES][LATENCY_BUCKETS]; // Time from a command arriving to its reply being sent, by type
+	unsigned long bytesIn;
+	unsigned long bytesOut;
+	long sendQueued; // Frames waiting in the send queues of the reactor's connections
+	long mailQueued; // Mail posted to the reactor that it has not handled yet
+};
 
-char *timestamp; // char pointer for the timestamp that prints to the terminal 
+// An event loop thread. Each reactor owns the connections it accepted, and other reactors reach
+// those connections only through its mailbox
+struct REACTOR {
+	pthread_t thread;
+	int port;
+	int mailFD; // eventfd that wakes the reactor when mail is posted
+	pthread_mutex_t mailLock;
+	struct MAIL * mailHead;
+	struct MAIL * mailTail;
+	struct STATS stats;
+};
+
+// A file in the file cache. Every download of the file shares the one copy loaded by the I/O threads. refs
+// counts the downloads using the file, plus one while it is in the cache, and the file is released when it drops to 0
+struct CACHED_FILE {
+	struct CACHED_FILE * next;
+	char filename[MAX_FILENAME];
+	int fd; // Downloads send from this descriptor with their own offsets
+	char * data; // The whole file mapped read-only, which keeps it in memory while it is cached (NULL for an empty file)
+	off_t size;
+	int refs;
+};
+
+// A cached file waiting to be pushed to a client over its own connection
+struct PUSH {
+	struct PUSH * next;
+	struct CACHED_FILE * file;
+	unsigned int id;
+	char sender[MAX_CRED + 1];
+};
+
+// A growable list of connection handles
+struct HANDLE_LIST {
+	conn_handle * handles;
+	int len;
+	int cap;
+};
+
+// A chat channel in the channel table. Its members are kept in one list per reactor, so a message to the channel is
+// handed to each reactor as the list of its own members. Empty entries have an empty name
+struct CHANNEL {
+	char name[MAX_CHANNEL_NAME + 1];
+	int nMembers;
+	struct HANDLE_LIST * members; // Members logged in on each reactor, indexed by reactor
+};
+
+// Each reactor thread has its own connection table and event backend
+__thread int reactorID; // Index of the reactor this thread runs
+__thread int nConns;	//total # of data sockets
+__thread int connLimit; // Maximum number of client connections of this reactor
+__thread struct pollfd * peers;	//sockets to be monitored by poll(), indexed by connection slot (unused slots have fd -1)
+__thread struct CONN_STAT * connStat;	//app-layer stats of the sockets, indexed by connection slot
+__thread int connCap; // Number of slots allocated in peers and connStat
+__thread int connHigh; // One past the highest slot that has been used
+__thread int freeSlot; // First slot in the free list (-1 if the free list is empty)
+
+__thread int epollFD; // epoll instance used by the epoll backend
+__thread struct epoll_event epollEvents[MAX_EVENTS]; // events returned by epoll_wait()
+__thread struct EVENT * ready; // sockets with pending events from the last wait
+__thread int acceptPending; // Set when connections were left in the accept queue because the server was full
+__thread struct HANDLE_LIST pendingFlush; // Connections with newly queued frames, flushed once the current batch of events is handled
+__thread struct HANDLE_LIST pendingClose; // Connections whose sends failed, closed once the current event is handled
+__thread struct HANDLE_LIST channelTargets; // Members of a channel on this reactor that a channel message is being queued for
+
+// Settings and tables shared by every reactor
+engine_type engine; // Event backend selected at startup (epoll by default, poll as a fallback)
+int maxConns; // Maximum number of client connections, set at startup and split evenly between the reactors
+int nReactors; // Number of event loop threads, set at startup
+struct REACTOR * reactors;
 int connID; // Running total of connection numbers
-int nConns;	//total # of data sockets
-struct pollfd peers[MAX_CONCURRENCY_LIMIT+1];	//sockets to be monitored by poll()
-struct CONN_STAT connStat[MAX_CONCURRENCY_LIMIT+1];	//app-layer stats of the sockets
 
-// returns a pointer to a timestamp with the current time when called
-char * getTimestamp() {
-	time_t timeNow;
-	time(&timeNow);
-	struct tm *now = localtime(&timeNow);
+int nIOThreads; // Number of disk I/O threads, set at startup
+pthread_mutex_t ioLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ioReady = PTHREAD_COND_INITIALIZER; // Signalled when a disk operation is submitted
+struct IO_JOB * ioHead; // Disk operations waiting for an I/O thread, oldest first
+struct IO_JOB * ioTail;
+long ioQueued; // Disk operations waiting for an I/O thread
+int statsInterval; // Seconds between stats reports, set at startup with -s (0 for none)
+
+struct CACHED_FILE * fileCache; // Files recently uploaded or downloaded, most recently used first
+int nCached; // Number of files in fileCache
+off_t cachedBytes; // Total size of the files in fileCache
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ONLINE_USER * online; // Open addressing hash table of the logged in users, keyed by username
+int onlineCap; // Number of entries in online (a power of two at least twice the connections of all reactors, so it never fills)
+pthread_mutex_t onlineLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct CHANNEL * channels; // Open addressing hash table of the channels, keyed by name
+int channelCap; // Number of entries in channels (a power of two at least twice MAX_CHANNELS, so it never fills)
+int nChannels;
+pthread_mutex_t channelLock = PTHREAD_MUTEX_INITIALIZER; // Guards the channel table and every channel's members
+
+struct ACCOUNT * accounts; // Open addressing hash table of every registered account, keyed by username
+int accountCap; // Number of entries in accounts (always a power of two)
+int nAccounts; // Number of registered accounts
+FILE * accountLog; // The accounts file, kept open so new accounts can be appended to it
+pthread_mutex_t accountLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Log lines are formatted by the thread that logs them into a slot of a lock-free ring, and a log thread writes them to
+// the terminal in batches so reactors never wait on stderr
+struct LOG_SLOT logRing[LOG_SLOTS];
+unsigned long logTail; // Next position claimed by a thread that logs
+unsigned long logHead; // Next position the log thread writes (guarded by logWriteLock)
+unsigned long logDropped; // Lines dropped because the ring was full since the last batch was written
+int logLevel = LOG_INFO; // Most verbose level written, raised with SIGUSR1 and lowered with SIGUSR2 at runtime
+pthread_mutex_t logWriteLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Formats a line into the next free slot of the log ring. If the ring is full the line is dropped and counted instead
+void LogV(int level, const char * format, va_list args) {
+	if (level > __atomic_load_n(&logLevel, __ATOMIC_RELAXED))
+		return;
+	
+	// Claim a slot, the position only moves on once the slot there has been written out by the log thread
+	unsigned long pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+	struct LOG_SLOT * slot;
+	while (1) {
+		slot = &logRing[pos & (LOG_SLOTS - 1)];
+		long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logTail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (diff < 0) {
+			__atomic_add_fetch(&logDropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&logTail, __ATOMIC_RELAXED);
+	}
 	
-	sprintf(timestamp, "[%02d:%02d:%02d]", now->tm_hour, now->tm_min, now->tm_sec);
-	return timestamp;
+	slot->when = time(NULL);
+	int len = vsnprintf(slot->text, LOG_LINE, format, args);
+	slot->len = len < 0 ? 0 : (len < LOG_LINE ? len : LOG_LINE - 1);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Logs a message at the given level
+void LogAt(int level, const char * format, ...) {
+	va_list argptr;
+	va_start(argptr, format);
+	LogV(level, format, argptr);
+	va_end(argptr);
 }
 
 // Prints a message to the terminal
 void Log(const char * format, ...) {
-	char msg[2048];
 	va_list argptr;
 	va_start(argptr, format);
-	vsprintf(msg, format, argptr);
+	LogV(LOG_INFO, format, argptr);
+	va_end(argptr);
+}
+
+// Writes a batch of log lines to stderr
+void WriteLog(const char * buf, int len) {
+	while (len > 0) {
+		int n = write(STDERR_FILENO, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+// Writes every line that is ready in the log ring to stderr, batching them into as few writes as possible. The timestamp
+// is only rebuilt when the second changes. Returns the number of lines written
+int FlushLog() {
+	static char batch[LOG_BATCH];
+	static char stamp[16];
+	static time_t stampTime = -1;
+	int nLines = 0, used = 0;
+	
+	pthread_mutex_lock(&logWriteLock);
+	while (1) {
+		struct LOG_SLOT * slot = &logRing[logHead & (LOG_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logHead + 1)
+			break;
+		
+		if (slot->when != stampTime) {
+			struct tm now;
+			localtime_r(&slot->when, &now);
+			sprintf(stamp, "[%02d:%02d:%02d]: ", now.tm_hour, now.tm_min, now.tm_sec);
+			stampTime = slot->when;
+		}
+		if (used + (int)sizeof(stamp) + slot->len + 1 > LOG_BATCH) {
+			WriteLog(batch, used);
+			used = 0;
+		}
+		int stampLen = strlen(stamp);
+		memcpy(batch + used, stamp, stampLen);
+		memcpy(batch + used + stampLen, slot->text, slot->len);
+		used += stampLen + slot->len;
+		batch[used++] = '\n';
+		
+		// Hand the slot back to the producers for its next trip around the ring
+		__atomic_store_n(&slot->seq, logHead + LOG_SLOTS, __ATOMIC_RELEASE);
+		logHead++;
+		nLines++;
+	}
+	
+	// The batch may be nearly full, so it is written out before the notice of dropped lines is added to it
+	unsigned long dropped = __atomic_exchange_n(&logDropped, 0, __ATOMIC_RELAXED);
+	if (dropped > 0) {
+		WriteLog(batch, used);
+		used = snprintf(batch, LOG_BATCH, "%s%lu log lines dropped, the log could not keep up.\n", stampTime < 0 ? "" : stamp, dropped);
+	}
+	WriteLog(batch, used);
+	pthread_mutex_unlock(&logWriteLock);
+	return nLines;
+}
+
+// Writes out whatever is still waiting when the server exits
+void FlushLogAtExit() {
+	FlushLog();
+}
+
+// Log thread, writes out the log ring and naps when it is empty
+void * RunLog(void * arg) {
+	struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+	while (1) {
+		if (FlushLog() == 0)
+			nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+// SIGUSR1 logs more and SIGUSR2 logs less, so a running server can be turned up to debug and back down
+void ChangeLogLevel(int sig) {
+	int level = __atomic_load_n(&logLevel, __ATOMIC_RELAXED) + (sig == SIGUSR1 ? 1 : -1);
+	if (level >= LOG_ERROR && level <= LOG_DEBUG)
+		__atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+}
+
+// Readies the log ring and starts the log thread. Lines logged before this would be dropped, so it runs first in main()
+void StartLog() {
+	for (int i = 0; i < LOG_SLOTS; i++)
+		logRing[i].seq = i;
+	atexit(FlushLogAtExit);
+	signal(SIGUSR1, ChangeLogLevel);
+	signal(SIGUSR2, ChangeLogLevel);
+	
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, RunLog, NULL) != 0) {
+		fprintf(stderr, "Cannot start the log thread.\n");
+		exit(-1);
+	}
+	pthread_detach(thread);
+}
+
+// Allows sockets to send in non-blocking mode by keeping track of the total amount of data received
+// Adds to a counter of this reactor's stats
+#define STAT_ADD(field, n) __atomic_add_fetch(&reactors[reactorID].stats.field, (n), __ATOMIC_RELAXED)
+
+// Returns a monotonic time in nanoseconds, for timing commands
+uint64_t NowNs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the latency histogram bucket of a time in microseconds. Below LATENCY_SUB every value has its own bucket, above
+// it each power of two is split into LATENCY_SUB buckets, so the buckets stay within 12.5% of the values they hold
+int LatencyBucket(uint64_t us) {
+	if (us < LATENCY_SUB)
+		return us;
+	if (us >> LATENCY_MAX_BITS)
+		return LATENCY_BUCKETS - 1;
+	int e = 63 - __builtin_clzll(us);
+	return (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB + ((us >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
+
+// Returns the smallest time in microseconds that falls in a latency histogram bucket
+uint64_t BucketLatency(int b) {
+	if (b < LATENCY_SUB)
+		return b;
+	int e = b / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+	return (uint64_t)(LATENCY_SUB + b % LATENCY_SUB) << (e - LATENCY_SUB_BITS);
+}
+
+// Records how long a command took, from its arrival until its reply was sent
+void RecordLatency(int type, uint64_t start) {
+	STAT_ADD(latency[type][LatencyBucket((NowNs() - start) / 1000)], 1);
+}
+
+int Recv_NonBlocking(int sockFD, BYTE * data, int len, struct CONN_STAT * pStat, struct pollfd * pPeer) {
+	while (pStat->nRecv < len) {
+		int n = recv(sockFD, data + pStat->nRecv, len - pStat->nRecv, 0);
+		if (n > 0) {
+			pStat->nRecv += n;
+			pStat->bytesIn += n;
+			STAT_ADD(bytesIn, n);
+		} else if (n == 0 || (n < 0 && errno == ECONNRESET)) {
+			// The caller removes the connection, which closes the socket. Closing it here as well could close a
+			// descriptor another thread has been handed the same number for in the meantime
+			return -1;
+		} else if (n < 0 && (errno == EWOULDBLOCK)) { 
+			return 0; 
+		} else {
+			Log("Unexpected recv error %d: %s.", errno, strerror(errno));
+			exit(-1);
+		}
+	}
+	
+	return 0;
+}
+
+// Number of fields the arguments of each command are split into. The last field takes the rest of the arguments, so
+// messages keep their spaces. Commands left out here, like FILEDATA, carry binary data and are not split at all
+static const unsigned char msgFields[NUM_MSG_TYPES] = {
+	[REGISTER] = 3, [LOGIN] = 3, [SEND] = 1, [SEND2] = 2, [SENDA] = 1, [SENDA2] = 2, [SENDF] = 3,
+	[RECVF] = 3, [RECVF4] = 4, [TERMINATE] = 2, [HELLO] = MAX_FIELDS, [PUTF] = 5, [RESUMEF] = 5, [JOIN] = 1, [PART] = 1,
+	[SENDC] = 2
+};
+
+// Commands a client may send: 1 for commands of any framing, 2 for those that came with v2 framing. The rest are only
+// sent by the server, or like DELAY never leave the client
+static const unsigned char fromClient[NUM_MSG_TYPES] = {
+	[IDLE] = 1, [REGISTER] = 1, [LOGIN] = 1, [LOGOUT] = 1, [SEND] = 1, [SEND2] = 1, [SENDA] = 1, [SENDA2] = 1,
+	[SENDF] = 1, [LIST] = 1, [RECVF] = 1, [RECVF4] = 1, [TERMINATE] = 1, [HELLO] = 2, [FILEDATA] = 2, [PUTF] = 2,
+	[RESUMEF] = 2, [FILEZ] = 2, [JOIN] = 2, [PART] = 2, [SENDC] = 2
+};
+
+// Splits the len bytes of a command's arguments into at most max fields, in place. Fields are separated by spaces,
+// and a trailing newline is dropped. Each command is split once as it arrives, and unlike strtok() there is no
+// hidden state, so every reactor can parse commands at the same time
+void SplitArgs(char * args, int len, int max, struct FIELDS * f) {
+	f->n = 0;
+	if (max == 0)
+		return;
+	if (len > 0 && args[len-1] == '\n')
+		len--;
+	args[len] = '\0';
+	
+	int pos = 0;
+	while (f->n < max) {
+		while (pos < len && args[pos] == ' ')
+			pos++;
+		if (pos == len)
+			break;
+		int start = pos;
+		if (f->n < max - 1) {
+			while (pos < len && args[pos] != ' ')
+				pos++;
+		}
+		else {
+			pos = len;
+		}
+		f->at[f->n] = args + start;
+		f->len[f->n] = pos - start;
+		f->n++;
+		if (pos < len)
+			args[pos++] = '\0';
+	}
+}
+
+// Sets a socket with a given file descriptor to non-blocking mode
+void SetNonBlockIO(int fd) {
+	int val = fcntl(fd, F_GETFL, 0);
+	if (fcntl(fd, F_SETFL, val | O_NONBLOCK) != 0) {
+		LogAt(LOG_ERROR, "Cannot set nonblocking I/O.");
+		exit(-1);
+	}
+}
+
+// Allocates a disk operation for the I/O threads
+struct IO_JOB * NewJob(io_type type, const char * filename) {
+	struct IO_JOB * job = (struct IO_JOB *)calloc(1, sizeof(struct IO_JOB));
+	if (job == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a disk operation.");
+		exit(-1);
+	}
+	job->type = type;
+	job->reactor = reactorID;
+	job->fd = -1;
+	snprintf(job->filename, sizeof(job->filename), "%s", filename);
+	return job;
+}
+
+// Hands a disk operation to the I/O threads
+void SubmitIO(struct IO_JOB * job) {
+	pthread_mutex_lock(&ioLock);
+	if (ioTail != NULL)
+		ioTail->next = job;
+	else
+		ioHead = job;
+	ioTail = job;
+	ioQueued++;
+	pthread_mutex_unlock(&ioLock);
+	pthread_cond_signal(&ioReady);
+}
+
+// Drops a reference to a cached file, unmapping and closing it once nothing uses it
+void CacheRelease(struct CACHED_FILE * f) {
+	pthread_mutex_lock(&cacheLock);
+	int refs = --f->refs;
+	pthread_mutex_unlock(&cacheLock);
+	
+	if (refs == 0) {
+		if (f->data != NULL)
+			munmap(f->data, f->size);
+		close(f->fd);
+		free(f);
+	}
+}
+
+// Returns a reference to the cached copy of a file, or NULL if the file is not in the cache
+struct CACHED_FILE * CacheFind(const char * filename) {
+	pthread_mutex_lock(&cacheLock);
+	struct CACHED_FILE ** link = &fileCache;
+	struct CACHED_FILE * f;
+	while ((f = *link) != NULL && strcmp(f->filename, filename)) {
+		link = &f->next;
+	}
+	
+	// Move the file to the front, so the files used least recently are evicted first
+	if (f != NULL) {
+		*link = f->next;
+		f->next = fileCache;
+		fileCache = f;
+		f->refs++;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return f;
+}
+
+// Loads a file into the file cache, replacing any earlier copy of it, and returns a reference to it. The file is
+// read in full here, so this runs on the I/O threads. Returns NULL and sets err if the file cannot be loaded
+struct CACHED_FILE * CacheLoad(const char * filename, int * err) {
+	struct stat st;
+	struct CACHED_FILE * f = (struct CACHED_FILE *)calloc(1, sizeof(struct CACHED_FILE));
+	if (f == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a file cache entry.");
+		exit(-1);
+	}
+	snprintf(f->filename, sizeof(f->filename), "%s", filename);
+	
+	if ((f->fd = open(filename, O_RDONLY)) < 0 || fstat(f->fd, &st) != 0) {
+		*err = errno;
+		if (f->fd >= 0)
+			close(f->fd);
+		free(f);
+		return NULL;
+	}
+	f->size = st.st_size;
+	
+	// A file too big for the cache is only mapped for the download that loaded it, and is read from disk as it is sent
+	int cached = (f->size <= FILE_CACHE_LIMIT);
+	if (f->size > 0) {
+		if ((f->data = (char *)mmap(NULL, f->size, PROT_READ, cached ? MAP_SHARED | MAP_POPULATE : MAP_SHARED, f->fd, 0)) == MAP_FAILED) {
+			*err = errno;
+			close(f->fd);
+			free(f);
+			return NULL;
+		}
+	}
+	f->refs = cached ? 2 : 1;
+	
+	pthread_mutex_lock(&cacheLock);
+	struct CACHED_FILE * evicted = NULL;
+	
+	// Take out the earlier copy of the file, then the files used least recently until the cache is within its limits.
+	// Files that are still being downloaded stay alive until their downloads finish
+	struct CACHED_FILE ** link = &fileCache;
+	while (*link != NULL) {
+		struct CACHED_FILE * old = *link;
+		if (!strcmp(old->filename, filename) || (cached && (cachedBytes + f->size > FILE_CACHE_LIMIT || nCached >= FILE_CACHE_FILES) && old->next == NULL)) {
+			*link = old->next;
+			nCached--;
+			cachedBytes -= old->size;
+			old->next = evicted;
+			evicted = old;
+			link = &fileCache;
+			continue;
+		}
+		link = &old->next;
+	}
+	if (cached) {
+		f->next = fileCache;
+		fileCache = f;
+		nCached++;
+		cachedBytes += f->size;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	
+	while (evicted != NULL) {
+		struct CACHED_FILE * next = evicted->next;
+		CacheRelease(evicted);
+		evicted = next;
+	}
+	return f;
+}
+
+// Allocates the buffer an upload is received into and has the I/O threads create its partial file. The upload is stored
+// under a temporary name until it is complete, so an earlier file with the same name is kept if the upload fails
+void BeginUpload(int i, struct CONN_STAT * stat, int resume) {
+	if ((stat->file = (char *)malloc(FILE_CHUNK)) == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a %d byte file buffer.", FILE_CHUNK);
+		exit(-1);
+	}
+	stat->nFile = 0;
+	stat->fileFD = -1;
+	stat->fileOff = 0;
+	
+	struct IO_JOB * job = NewJob(IO_CREATE, stat->filename);
+	job->handle = HANDLE(i);
+	job->resume = resume;
+	job->off = stat->nToRecv;
+	strcpy(job->xfer, stat->xfer);
+	stat->ioBusy = 1;
+	SubmitIO(job);
+}
+
+// Frees the buffers of an upload that did not finish and has its partial file deleted. If a disk operation
+// is still in flight, the partial file is deleted once that operation finishes instead
+void AbortUpload(struct CONN_STAT * stat) {
+	free(stat->file);
+	free(stat->spare);
+	stat->file = NULL;
+	stat->spare = NULL;
+	
+	if (!stat->ioBusy && !stat->committing) {
+		struct IO_JOB * job = NewJob(IO_ABORT, stat->filename);
+		job->fd = stat->fileFD;
+		strcpy(job->xfer, stat->xfer);
+		SubmitIO(job);
+	}
+}
+
+// Stops reading from a connection until the disk operation its upload is waiting for has finished, when FinishIO()
+// carries on with it. poll() is level-triggered and would otherwise report the unread data on every pass, while epoll
+// only reports the socket when more data arrives
+void StopReading(int i) {
+	peers[i].events &= ~POLLRDNORM;
+}
+
+// Hands the next disk operation of an upload to the I/O threads, unless one is already in flight. Full buffers are
+// written while the other buffer is being received into, and the file is committed once all of it has been written
+void PumpUpload(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	struct IO_JOB * job;
+	int received = (stat->fileOff + stat->nFile == stat->nToRecv);
+	
+	if (stat->file == NULL || stat->ioBusy || stat->committing)
+		return;
+	
+	if (stat->nFile == FILE_CHUNK || (received && stat->nFile > 0)) {
+		job = NewJob(IO_WRITE, stat->filename);
+		job->fd = stat->fileFD;
+		job->buf = stat->file;
+		job->len = stat->nFile;
+		job->off = stat->fileOff;
+		stat->fileOff += stat->nFile;
+		
+		// Keep receiving into the other buffer
+		stat->file = stat->spare;
+		stat->spare = NULL;
+		stat->nFile = 0;
+		if (stat->file == NULL && (stat->file = (char *)malloc(FILE_CHUNK)) == NULL) {
+			LogAt(LOG_ERROR, "Cannot allocate a %d byte file buffer.", FILE_CHUNK);
+			exit(-1);
+		}
+	}
+	else if (received) {
+		// Everything has been written. The announcement goes with the operation, so it is made even if the client hangs up
+		job = NewJob(IO_COMMIT, stat->filename);
+		job->fd = stat->fileFD;
+		job->msg = stat->fileRecip[0] ? RECVF4 : RECVF;
+		strcpy(job->user, stat->fileUser);
+		strcpy(job->recip, stat->fileRecip);
+		stat->committing = 1;
+	}
+	else {
+		return;
+	}
+	
+	job->handle = HANDLE(i);
+	strcpy(job->xfer, stat->xfer);
+	stat->ioBusy = 1;
+	SubmitIO(job);
+}
+
+// Receives the next part of an upload. Each time the buffer fills up it is handed to the I/O threads to be written,
+// so memory used by an upload does not depend on the size of the file. If the previous chunk is still being written,
+// reading stops until it is done. Returns 1 once the whole file has been received, 0 if the socket would block or
+// reading has stopped, or -1 if the connection failed
+int RecvUpload(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	
+	while (stat->fileOff + stat->nFile < stat->nToRecv) {
+		if (stat->nFile == FILE_CHUNK) {
+			PumpUpload(i);
+			if (stat->nFile == FILE_CHUNK) {
+				StopReading(i);
+				return 0;
+			}
+		}
+		
+		int len = FILE_CHUNK - stat->nFile;
+		if (len > stat->nToRecv - stat->fileOff - stat->nFile)
+			len = stat->nToRecv - stat->fileOff - stat->nFile;
+		
+		int n = recv(peers[i].fd, stat->file + stat->nFile, len, 0);
+		if (n > 0) {
+			stat->nFile += n;
+			stat->bytesIn += n;
+			STAT_ADD(bytesIn, n);
+		} else if (n == 0 || (n < 0 && errno == ECONNRESET)) {
+			return -1;
+		} else if (n < 0 && errno == EWOULDBLOCK) {
+			return 0;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			Log("Unexpected recv error %d: %s.", errno, strerror(errno));
+			exit(-1);
+		}
+	}
+	
+	return 1;
+}
+
+// Starts monitoring the socket stored in slot i of peers
+void EngineAdd(int i) {
+	int fd = peers[i].fd;
+	
+	// poll() reads its interest set straight from peers, so only epoll has to be told about the socket.
+	// Sockets are registered edge-triggered for both directions once, so no epoll_ctl() calls are needed
+	// when a socket starts or stops waiting to write
+	if (engine == ENGINE_EPOLL) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = (i < FIRST_SLOT) ? (EPOLLIN | EPOLLET) : (EPOLLIN | EPOLLOUT | EPOLLET);
+		ev.data.u64 = HANDLE(i);
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) != 0) {
+			LogAt(LOG_ERROR, "Cannot add socket to epoll instance (%d: %s).", errno, strerror(errno));
+			exit(-1);
+		}
+	}
+}
+
+// Stops monitoring a socket that is about to be closed
+void EngineRemove(int fd) {
+	// The descriptor is only closed by RemoveConnection() after this, so it is still registered
+	if (engine == ENGINE_EPOLL)
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Creates the epoll instance (if it is the selected backend) and registers the listening socket and mailbox
+void EngineInit() {
+	if (engine == ENGINE_EPOLL) {
+		if ((epollFD = epoll_create1(0)) < 0) {
+			LogAt(LOG_ERROR, "Cannot create epoll instance.");
+			exit(-1);
+		}
+	}
+	
+	EngineAdd(LISTEN_SLOT);
+	EngineAdd(MAILBOX_SLOT);
+}
+
+// Waits for socket events and stores the ready sockets in the ready array. Returns the number of ready sockets
+int EngineWait() {
+	int n = 0;
+	
+	if (engine == ENGINE_EPOLL) {
+		int r = epoll_wait(epollFD, epollEvents, MAX_EVENTS, -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				return 0;
+			Log("Invalid epoll_wait() return value.");
+			exit(-1);
+		}
+		
+		// Translate the epoll flags into the poll flags the connection handlers check for
+		for (int k=0; k<r; k++) {
+			uint32_t ev = epollEvents[k].events;
+			ready[n].handle = epollEvents[k].data.u64;
+			ready[n].revents = 0;
+			if (ev & EPOLLIN)
+				ready[n].revents |= POLLRDNORM;
+			if (ev & EPOLLOUT)
+				ready[n].revents |= POLLWRNORM;
+			if (ev & EPOLLERR)
+				ready[n].revents |= POLLERR;
+			if (ev & EPOLLHUP)
+				ready[n].revents |= POLLHUP;
+			n++;
+		}
+	}
+	else {
+		int r = poll(peers, connHigh, -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				return 0;
+			Log("Invalid poll() return value.");
+			exit(-1);
+		}
+		
+		// poll() only reports how many sockets are ready, so every socket has to be checked
+		for (int i=0; i<connHigh && n<r; i++) {
+			if (peers[i].revents) {
+				ready[n].handle = HANDLE(i);
+				ready[n].revents = peers[i].revents;
+				n++;
+			}
+		}
+	}
+	
+	return n;
+}
+
+// Returns the slot of the connection a handle refers to, or -1 if that connection has been closed
+// or belongs to another reactor
+int HandleToConn(conn_handle h) {
+	int i = HANDLE_SLOT(h);
+	if (HANDLE_REACTOR(h) != reactorID || i < FIRST_SLOT || i >= connHigh || peers[i].fd < 0 || connStat[i].gen != (unsigned int)(h >> 32))
+		return -1;
+	return i;
+}
+
+// Hashes a username with FNV-1a
+unsigned int HashName(const char * name) {
+	unsigned int h = 2166136261u;
+	while (*name) {
+		h ^= (BYTE)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Returns the entry of the online user index that holds the given username, or the empty entry where it would be added
+struct ONLINE_USER * OnlineSlot(const char * user) {
+	unsigned int k = HashName(user) & (onlineCap - 1);
+	while (online[k].user[0] != '\0' && strcmp(online[k].user, user)) {
+		k = (k + 1) & (onlineCap - 1);
+	}
+	return &online[k];
+}
+
+// Looks up the connection the given user is logged in on. Returns 1 and stores the connection's handle in h
+// if the user is online, or 0 if they are not
+int FindOnline(const char * user, conn_handle * h) {
+	pthread_mutex_lock(&onlineLock);
+	struct ONLINE_USER * entry = OnlineSlot(user);
+	int found = (entry->user[0] != '\0');
+	if (found)
+		*h = entry->handle;
+	pthread_mutex_unlock(&onlineLock);
+	return found;
+}
+
+// Adds a user logged in on a connection to the online user index. Returns -1 if the user is already
+// online, which is checked under the same lock so two reactors can never log in the same user
+int SetOnline(int i, const char * user) {
+	int r = -1;
+	pthread_mutex_lock(&onlineLock);
+	struct ONLINE_USER * entry = OnlineSlot(user);
+	if (entry->user[0] == '\0') {
+		strcpy(entry->user, user);
+		entry->handle = HANDLE(i);
+		entry->ID = connStat[i].ID;
+		r = 0;
+	}
+	pthread_mutex_unlock(&onlineLock);
+	return r;
+}
+
+// Removes the user logged in on a connection from the online user index. Entries after it in the same
+// run are shifted back into the hole, so lookups never have to step over deleted entries
+void ClearOnline(int i) {
+	pthread_mutex_lock(&onlineLock);
+	struct ONLINE_USER * entry = OnlineSlot(connStat[i].user);
+	if (entry->user[0] == '\0') {
+		pthread_mutex_unlock(&onlineLock);
+		return;
+	}
+	
+	int hole = entry - online;
+	int k = hole;
+	while (1) {
+		k = (k + 1) & (onlineCap - 1);
+		if (online[k].user[0] == '\0')
+			break;
+		
+		// An entry can fill the hole if the hole lies between its home position and where it is now
+		int home = HashName(online[k].user) & (onlineCap - 1);
+		if (((k - home) & (onlineCap - 1)) >= ((k - hole) & (onlineCap - 1))) {
+			online[hole] = online[k];
+			hole = k;
+		}
+	}
+	memset(&online[hole], 0, sizeof(struct ONLINE_USER));
+	pthread_mutex_unlock(&onlineLock);
+}
+
+// Returns the entry of the channel table that holds the given channel, or the empty entry where it would be added
+struct CHANNEL * ChannelSlot(const char * name) {
+	unsigned int k = HashName(name) & (channelCap - 1);
+	while (channels[k].name[0] != '\0' && strcmp(channels[k].name, name)) {
+		k = (k + 1) & (channelCap - 1);
+	}
+	return &channels[k];
+}
+
+// Removes a connection from the members of a channel. Must be called with channelLock held
+void RemoveMember(struct CHANNEL * c, conn_handle h) {
+	struct HANDLE_LIST * list = &c->members[HANDLE_REACTOR(h)];
+	for (int k=0; k<list->len; k++) {
+		if (list->handles[k] == h) {
+			list->handles[k] = list->handles[--list->len];
+			c->nMembers--;
+			return;
+		}
+	}
+}
+
+// Takes the user logged in on a connection out of every channel they are in
+void LeaveChannels(int i) {
+	if (connStat[i].nJoined == 0)
+		return;
+	pthread_mutex_lock(&channelLock);
+	for (int k=0; k<connStat[i].nJoined; k++) {
+		RemoveMember(connStat[i].joined[k], HANDLE(i));
+	}
+	pthread_mutex_unlock(&channelLock);
+	connStat[i].nJoined = 0;
+}
+
+// Takes a slot from the free list, or grows the connection table if none are free. Returns -1 if the server is full
+int AllocConnection() {
+	if (freeSlot < 0) {
+		// The first slots hold the listening socket and the mailbox, so the table holds at most connLimit+FIRST_SLOT slots
+		if (connHigh >= connLimit + FIRST_SLOT)
+			return -1;
+		
+		if (connHigh == connCap) {
+			int newCap = connCap * 2;
+			if (newCap > connLimit + FIRST_SLOT)
+				newCap = connLimit + FIRST_SLOT;
+			
+			peers = (struct pollfd *)realloc(peers, sizeof(struct pollfd) * newCap);
+			connStat = (struct CONN_STAT *)realloc(connStat, sizeof(struct CONN_STAT) * newCap);
+			ready = (struct EVENT *)realloc(ready, sizeof(struct EVENT) * (newCap > MAX_EVENTS ? newCap : MAX_EVENTS));
+			if (peers == NULL || connStat == NULL || ready == NULL) {
+				LogAt(LOG_ERROR, "Cannot grow connection table to %d slots.", newCap);
+				exit(-1);
+			}
+			memset(peers + connCap, 0, sizeof(struct pollfd) * (newCap - connCap));
+			memset(connStat + connCap, 0, sizeof(struct CONN_STAT) * (newCap - connCap));
+			connCap = newCap;
+		}
+		
+		return connHigh++;
+	}
+	
+	int i = freeSlot;
+	freeSlot = connStat[i].nextFree;
+	return i;
+}
+
+// Allocates a zero-filled frame that holds len bytes
+struct FRAME * NewFrame(int len) {
+	struct FRAME * f = (struct FRAME *)calloc(1, sizeof(struct FRAME) + len);
+	if (f == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a %d byte frame.", len);
+		exit(-1);
+	}
+	f->len = len;
+	f->refs = 1;
+	return f;
+}
+
+// Drops a reference to a frame, freeing it once nothing holds it. A frame only one queue holds cannot be released
+// anywhere else at the same time, so that common case skips the atomic decrement
+void ReleaseFrame(struct FRAME * f) {
+	if (__atomic_load_n(&f->refs, __ATOMIC_ACQUIRE) == 1 || __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(f);
+}
+
+// Closes a socket and returns its slot to the free list. The slots of other connections are never moved
+void RemoveConnection(int i) {
+	Log("Connection with client (ID %d) closed (%ld bytes received, %ld bytes sent).", connStat[i].ID, connStat[i].bytesIn, connStat[i].bytesOut);
+	if (connStat[i].loggedIn) {
+		LeaveChannels(i);
+		ClearOnline(i);
+	}
+	EngineRemove(peers[i].fd);
+	close(peers[i].fd);	
+	
+	// Drop anything still waiting to be sent
+	for (int k=0; k<connStat[i].qLen; k++) {
+		ReleaseFrame(connStat[i].sendQueue[(connStat[i].qHead + k) % connStat[i].qCap]);
+	}
+	STAT_ADD(sendQueued, -connStat[i].qLen);
+	free(connStat[i].sendQueue);
+	free(connStat[i].dataRecv);
+	
+	// Throw away the partial file of an upload that did not finish
+	if (connStat[i].file != NULL)
+		AbortUpload(&connStat[i]);
+	if (connStat[i].isFileRequest)
+		CacheRelease(connStat[i].sendFile);
+	while (connStat[i].pushHead != NULL) {
+		struct PUSH * p = connStat[i].pushHead;
+		connStat[i].pushHead = p->next;
+		CacheRelease(p->file);
+		free(p);
+	}
+	
+	// Bump the generation so any handle still referring to this connection becomes stale
+	unsigned int gen = connStat[i].gen + 1;
+	memset(&connStat[i], 0, sizeof(struct CONN_STAT));
+	connStat[i].gen = gen;
+	connStat[i].nextFree = freeSlot;
+	freeSlot = i;
+	
+	peers[i].fd = -1;
+	peers[i].events = 0;
+	peers[i].revents = 0;
+	nConns--;
+}
+
+// Adds a connection handle to a handle list
+void PushHandle(struct HANDLE_LIST * list, conn_handle h) {
+	if (list->len == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		if ((list->handles = (conn_handle *)realloc(list->handles, sizeof(conn_handle) * list->cap)) == NULL) {
+			LogAt(LOG_ERROR, "Cannot grow connection list to %d entries.", list->cap);
+			exit(-1);
+		}
+	}
+	list->handles[list->len++] = h;
+}
+
+// Marks a connection to be closed once the current event has been handled. Used when a send fails
+// while fanning out to other connections, where removing the connection right away is not safe
+void CloseLater(int i) {
+	if (!connStat[i].closing) {
+		connStat[i].closing = 1;
+		PushHandle(&pendingClose, HANDLE(i));
+	}
+}
+
+// Closes all connections that were marked by CloseLater
+void ReapConnections() {
+	for (int k=0; k<pendingClose.len; k++) {
+		int i = HandleToConn(pendingClose.handles[k]);
+		if (i >= 0) {
+			RemoveConnection(i);
+		}
+	}
+	pendingClose.len = 0;
+}
+
+// Appends a frame to the outbound queue of a connection. Nothing is sent yet; the connection is flushed after the
+// current batch of events is handled so that everything queued for it in the meantime goes out in one writev()
+void QueueFrame(int i, struct FRAME * f) {
+	struct CONN_STAT * stat = &connStat[i];
+	
+	if (stat->closing) {
+		ReleaseFrame(f);
+		return;
+	}
+	
+	// A client that stops reading would otherwise make its queue grow without bound
+	if (stat->qLen == MAX_SEND_QUEUE) {
+		Log("Client (ID %d) has %d unsent frames. Closing connection.", stat->ID, stat->qLen);
+		ReleaseFrame(f);
+		CloseLater(i);
+		return;
+	}
+	
+	// Grow the ring, unwrapping it so the oldest frame is at the front again
+	if (stat->qLen == stat->qCap) {
+		int newCap = stat->qCap ? stat->qCap * 2 : 8;
+		struct FRAME ** q = (struct FRAME **)malloc(sizeof(struct FRAME *) * newCap);
+		if (q == NULL) {
+			LogAt(LOG_ERROR, "Cannot grow send queue to %d frames.", newCap);
+			exit(-1);
+		}
+		for (int k=0; k<stat->qLen; k++) {
+			q[k] = stat->sendQueue[(stat->qHead + k) % stat->qCap];
+		}
+		free(stat->sendQueue);
+		stat->sendQueue = q;
+		stat->qHead = 0;
+		stat->qCap = newCap;
+	}
+	
+	stat->sendQueue[(stat->qHead + stat->qLen) % stat->qCap] = f;
+	stat->qLen++;
+	STAT_ADD(sendQueued, 1);
+	
+	if (!stat->flushPending) {
+		stat->flushPending = 1;
+		PushHandle(&pendingFlush, HANDLE(i));
+	}
+}
+
+// Returns a new frame holding a command with an already formatted body in the given framing
+struct FRAME * EncodeCmd(framing_type framing, int type, const char * body, int len) {
+	// v1 frames are always CMD_LEN bytes, while v2 frames are only as long as their body
+	struct FRAME * f = NewFrame((framing == FRAMING_V2) ? FRAME_HDR_LEN + len : CMD_LEN);
+	EncodeFrame((BYTE *)f->data, framing, type, body, len);
+	return f;
+}
+
+// Queues a command with an already formatted body for a connection in the framing that client uses
+void QueueCmd(int i, int type, const char * body, int len) {
+	QueueFrame(i, EncodeCmd(connStat[i].framing, type, body, len));
+}
+
+// Formats the body of a command into body, which holds MAX_BODY_LEN+1 bytes. Returns the length of the body
+int FormatBody(char * body, const char * format, va_list argptr) {
+	if (format == NULL)
+		return 0;
+	int len = vsnprintf(body, MAX_BODY_LEN + 1, format, argptr);
+	return (len > MAX_BODY_LEN) ? MAX_BODY_LEN : len;
+}
+
+// Formats the body of a command and queues the command for a connection in the framing that client uses.
+// format may be NULL for commands without a body
+void SendCmd(int i, int type, const char * format, ...) {
+	char body[MAX_BODY_LEN + 1];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = FormatBody(body, format, argptr);
+	va_end(argptr);
+	QueueCmd(i, type, body, len);
+}
+
+// Allocates a message for a reactor's mailbox with a copy of the given body
+struct MAIL * NewMail(mail_type kind, conn_handle h, int type, const char * body, int len) {
+	struct MAIL * m = (struct MAIL *)malloc(sizeof(struct MAIL) + len + 1);
+	if (m == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a %d byte message.", len);
+		exit(-1);
+	}
+	m->next = NULL;
+	m->kind = kind;
+	m->handle = h;
+	m->type = type;
+	m->job = NULL;
+	m->frames[0] = m->frames[1] = NULL;
+	m->len = len;
+	memcpy(m->body, body, len);
+	m->body[len] = '\0';
+	return m;
+}
+
+// Adds a message to a reactor's mailbox and wakes the reactor up. Reactors and I/O threads both post mail
+void PushMail(int r, struct MAIL * m) {
+	struct REACTOR * reactor = &reactors[r];
+	pthread_mutex_lock(&reactor->mailLock);
+	if (reactor->mailTail != NULL)
+		reactor->mailTail->next = m;
+	else
+		reactor->mailHead = m;
+	reactor->mailTail = m;
+	pthread_mutex_unlock(&reactor->mailLock);
+	__atomic_add_fetch(&reactor->stats.mailQueued, 1, __ATOMIC_RELAXED);
+	
+	uint64_t one = 1;
+	if (write(reactor->mailFD, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		LogAt(LOG_ERROR, "Cannot wake reactor %d (%d: %s).", r, errno, strerror(errno));
+		exit(-1);
+	}
+}
+
+// Hands a message to another reactor and wakes it up
+void PostMail(int r, mail_type kind, conn_handle h, int type, const char * body, int len) {
+	PushMail(r, NewMail(kind, h, type, body, len));
+}
+
+// Round constants of SHA-256
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Adds one 64 byte block to a SHA-256 hash state
+void Sha256Block(uint32_t * h, const unsigned char * block) {
+	uint32_t w[64];
+	for (int t = 0; t < 16; t++)
+		w[t] = ((uint32_t)block[4*t] << 24) | ((uint32_t)block[4*t + 1] << 16) | ((uint32_t)block[4*t + 2] << 8) | block[4*t + 3];
+	for (int t = 16; t < 64; t++) {
+		uint32_t s0 = ROTR(w[t-15], 7) ^ ROTR(w[t-15], 18) ^ (w[t-15] >> 3);
+		uint32_t s1 = ROTR(w[t-2], 17) ^ ROTR(w[t-2], 19) ^ (w[t-2] >> 10);
+		w[t] = w[t-16] + s0 + w[t-7] + s1;
+	}
+	
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+	for (int t = 0; t < 64; t++) {
+		uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[t] + w[t];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+// Computes the SHA-256 hash of a file, reading it a chunk at a time. Returns 0, or errno if the file cannot be read
+int HashFile(const char * path, unsigned char * hash) {
+	uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	unsigned char buf[FILE_CHUNK + 128];
+	uint64_t total = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno;
+	
+	// FILE_CHUNK is a multiple of the block size, so only the last read can leave a partial block
+	while (1) {
+		ssize_t n = read(fd, buf, FILE_CHUNK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			int err = errno;
+			close(fd);
+			return err;
+		}
+		total += n;
+		
+		int whole = n - n % 64;
+		for (int off = 0; off < whole; off += 64)
+			Sha256Block(h, buf + off);
+		if (n == FILE_CHUNK)
+			continue;
+		
+		// Pad the last block with a 1 bit, zeros and the length of the file in bits
+		int rest = n - whole;
+		memmove(buf, buf + whole, rest);
+		buf[rest++] = 0x80;
+		int padded = (rest <= 56) ? 64 : 128;
+		memset(buf + rest, 0, padded - rest);
+		for (int b = 0; b < 8; b++)
+			buf[padded - 1 - b] = (unsigned char)((total * 8) >> (8 * b));
+		for (int off = 0; off < padded; off += 64)
+			Sha256Block(h, buf + off);
+		break;
+	}
+	close(fd);
+	
+	for (int t = 0; t < 8; t++) {
+		hash[4*t] = h[t] >> 24;
+		hash[4*t + 1] = h[t] >> 16;
+		hash[4*t + 2] = h[t] >> 8;
+		hash[4*t + 3] = h[t];
+	}
+	return 0;
+}
+
+// Moves a completed upload into the content-addressed store and points filename at it. Files with the same contents
+// are stored once: if the store already holds the upload's hash, the upload is dropped and filename shares the copy
+// that is there. filename becomes a symbolic link to its blob, which also records the name's hash. Returns 0, or
+// errno if the upload cannot be stored
+int StoreFile(const char * partName, const char * filename, int * duplicate) {
+	unsigned char hash[HASH_LEN];
+	char blob[sizeof(STORE_DIR) + 2 * HASH_LEN + 1];
+	struct stat st;
+	int err;
+	
+	if ((err = HashFile(partName, hash)) != 0)
+		return err;
+	int n = sprintf(blob, "%s/", STORE_DIR);
+	for (int b = 0; b < HASH_LEN; b++)
+		n += sprintf(blob + n, "%02x", hash[b]);
+	
+	*duplicate = (stat(blob, &st) == 0);
+	if (*duplicate)
+		unlink(partName);
+	else if (rename(partName, blob) != 0)
+		return errno;
+	
+	// The link is made under the partial file's name and renamed over filename, so the name is replaced in one step
+	if (symlink(blob, partName) != 0 || rename(partName, filename) != 0)
+		return errno;
+	return 0;
+}
+
+// Carries out one disk operation on an I/O thread
+void RunJob(struct IO_JOB * job) {
+	// Resumable uploads have a partial file of their own, so a later attempt can find it
+	char partName[MAX_FILENAME + XFER_LEN + 8];
+	if (job->xfer[0])
+		snprintf(partName, sizeof(partName), "%s.%s.part", job->filename, job->xfer);
+	else
+		snprintf(partName, sizeof(partName), "%s.part", job->filename);
+	
+	switch (job->type) {
+		case IO_CREATE: {
+			struct stat st;
+			if ((job->fd = open(partName, O_WRONLY | O_CREAT | (job->resume ? 0 : O_TRUNC), 0644)) < 0) {
+				job->err = errno;
+				break;
+			}
+			
+			// A resumed upload carries on after what was written before. off holds the size of the file on the way in,
+			// and a partial file longer than that cannot belong to the upload
+			if (job->resume) {
+				if (fstat(job->fd, &st) != 0) {
+					job->err = errno;
+				}
+				else if (st.st_size > job->off) {
+					job->off = 0;
+					if (ftruncate(job->fd, 0) != 0)
+						job->err = errno;
+				}
+				else {
+					job->off = st.st_size;
+				}
+			}
+			break;
+		}
+		case IO_WRITE: {
+			int nWritten = 0;
+			while (nWritten < job->len) {
+				ssize_t n = pwrite(job->fd, job->buf + nWritten, job->len - nWritten, job->off + nWritten);
+				if (n < 0) {
+					if (errno == EINTR)
+						continue;
+					job->err = errno;
+					break;
+				}
+				nWritten += n;
+			}
+			break;
+		}
+		case IO_COMMIT: {
+			close(job->fd);
+			if ((job->err = StoreFile(partName, job->filename, &job->duplicate)) != 0)
+				break;
+			
+			// Load the new file into the file cache while it is still in the page cache, as everyone it is
+			// announced to is about to download it. This also replaces any earlier copy of the file
+			int err;
+			struct CACHED_FILE * f = CacheLoad(job->filename, &err);
+			if (f != NULL)
+				CacheRelease(f);
+			break;
+		}
+		case IO_ABORT:
+			if (job->fd >= 0)
+				close(job->fd);
+			
+			// The partial file of a resumable upload is kept for the client to resume it later
+			if (!job->xfer[0])
+				unlink(partName);
+			break;
+		case IO_OPEN:
+			// The whole file is read in here, so sendfile() on the event loop never waits for the disk
+			job->cached = CacheLoad(job->filename, &job->err);
+			break;
+		case IO_APPEND: {
+			// The accounts file is opened for appending, so each line is written to its end in one go
+			if (write(job->fd, job->buf, job->len) != job->len)
+				LogAt(LOG_ERROR, "Cannot append to %s (%d: %s).", ACCOUNT_FILE, errno, strerror(errno));
+			break;
+		}
+	}
+}
+
+// Runs on each I/O thread, carrying out disk operations as they are submitted and posting
+// the results back to the reactors that submitted them
+void * IOWorker(void * arg) {
+	while (1) {
+		pthread_mutex_lock(&ioLock);
+		while (ioHead == NULL)
+			pthread_cond_wait(&ioReady, &ioLock);
+		struct IO_JOB * job = ioHead;
+		ioHead = job->next;
+		if (ioHead == NULL)
+			ioTail = NULL;
+		ioQueued--;
+		pthread_mutex_unlock(&ioLock);
+		
+		RunJob(job);
+		
+		if (job->type == IO_ABORT || job->type == IO_APPEND) {
+			free(job->buf);
+			free(job);
+			continue;
+		}
+		struct MAIL * m = NewMail(MAIL_IO, job->handle, 0, "", 0);
+		m->job = job;
+		PushMail(job->reactor, m);
+	}
+	return NULL;
+}
+
+// Sends a command to the connection a handle refers to, wherever it is. Connections of this reactor are
+// queued directly, while connections of other reactors are reached through their mailbox
+void DeliverCmd(conn_handle h, int type, const char * format, ...) {
+	char body[MAX_BODY_LEN + 1];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = FormatBody(body, format, argptr);
+	va_end(argptr);
+	
+	if (HANDLE_REACTOR(h) != reactorID) {
+		PostMail(HANDLE_REACTOR(h), MAIL_CMD, h, type, body, len);
+		return;
+	}
+	int i = HandleToConn(h);
+	if (i >= 0)
+		QueueCmd(i, type, body, len);
+}
+
+// Queues a broadcast for every user logged in on this reactor, sharing its v1 and v2 frames between their queues,
+// then drops the caller's reference to the frames. The references the queues take are added up front, with one
+// atomic add per frame, so a queue that refuses a frame cannot free it while the rest are still being queued
+void BroadcastLocal(struct FRAME * frames[2]) {
+	int refs[2] = {0, 0};
+	for (int j=FIRST_SLOT; j<connHigh; j++) {
+		if (connStat[j].loggedIn)
+			refs[connStat[j].framing == FRAMING_V2]++;
+	}
+	for (int k=0; k<2; k++) {
+		if (refs[k] > 0)
+			__atomic_add_fetch(&frames[k]->refs, refs[k], __ATOMIC_RELAXED);
+	}
+	
+	for (int j=FIRST_SLOT; j<connHigh; j++) {
+		if (connStat[j].loggedIn)
+			QueueFrame(j, frames[connStat[j].framing == FRAMING_V2]);
+	}
+	ReleaseFrame(frames[0]);
+	ReleaseFrame(frames[1]);
+}
+
+// Sends a command to every user that is logged in, on every reactor. The command is formatted and encoded once in
+// each framing, and every recipient's queue points at the same frame instead of holding a copy
+void BroadcastCmd(int type, const char * format, ...) {
+	char body[MAX_BODY_LEN + 1];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = FormatBody(body, format, argptr);
+	va_end(argptr);
+	
+	struct FRAME * frames[2] = {EncodeCmd(FRAMING_V1, type, body, len), EncodeCmd(FRAMING_V2, type, body, len)};
+	if (nReactors > 1) {
+		__atomic_add_fetch(&frames[0]->refs, nReactors - 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&frames[1]->refs, nReactors - 1, __ATOMIC_RELAXED);
+	}
+	for (int r=0; r<nReactors; r++) {
+		if (r != reactorID) {
+			struct MAIL * m = NewMail(MAIL_BROADCAST, 0, type, "", 0);
+			m->frames[0] = frames[0];
+			m->frames[1] = frames[1];
+			PushMail(r, m);
+		}
+	}
+	BroadcastLocal(frames);
+}
+
+// Queues a broadcast for the connections of this reactor in a list of handles, skipping any that have closed, then
+// drops the caller's reference to the frames. References are taken up front as in BroadcastLocal()
+void MulticastLocal(const conn_handle * handles, int n, struct FRAME * frames[2]) {
+	int refs[2] = {0, 0};
+	for (int k=0; k<n; k++) {
+		int i = HandleToConn(handles[k]);
+		if (i >= 0 && connStat[i].loggedIn)
+			refs[connStat[i].framing == FRAMING_V2]++;
+	}
+	for (int k=0; k<2; k++) {
+		if (refs[k] > 0)
+			__atomic_add_fetch(&frames[k]->refs, refs[k], __ATOMIC_RELAXED);
+	}
+	
+	for (int k=0; k<n; k++) {
+		int i = HandleToConn(handles[k]);
+		if (i >= 0 && connStat[i].loggedIn)
+			QueueFrame(i, frames[connStat[i].framing == FRAMING_V2]);
+	}
+	ReleaseFrame(frames[0]);
+	ReleaseFrame(frames[1]);
+}
+
+// Sends a command to every member of a channel. The frames are shared as with BroadcastCmd(), and each reactor with
+// members is handed the list of its own, so the work done grows with the channel and not with the users online
+void ChannelCmd(struct CHANNEL * c, int type, const char * format, ...) {
+	char body[MAX_BODY_LEN + 1];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = FormatBody(body, format, argptr);
 	va_end(argptr);
-	fprintf(stderr, "%s: %s\n", getTimestamp(), msg);
+	
+	struct FRAME * frames[2] = {EncodeCmd(FRAMING_V1, type, body, len), EncodeCmd(FRAMING_V2, type, body, len)};
+	pthread_mutex_lock(&channelLock);
+	for (int r=0; r<nReactors; r++) {
+		struct HANDLE_LIST * list = &c->members[r];
+		if (r == reactorID || list->len == 0)
+			continue;
+		struct MAIL * m = NewMail(MAIL_CHANNEL, 0, type, (const char *)list->handles, list->len * sizeof(conn_handle));
+		m->frames[0] = frames[0];
+		m->frames[1] = frames[1];
+		__atomic_add_fetch(&frames[0]->refs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&frames[1]->refs, 1, __ATOMIC_RELAXED);
+		PushMail(r, m);
+	}
+	
+	// Members on this reactor are copied out, since queuing to them does not need the lock
+	struct HANDLE_LIST * local = &c->members[reactorID];
+	channelTargets.len = 0;
+	for (int k=0; k<local->len; k++) {
+		PushHandle(&channelTargets, local->handles[k]);
+	}
+	pthread_mutex_unlock(&channelLock);
+	MulticastLocal(channelTargets.handles, channelTargets.len, frames);
+}
+
+// Sends as much of a connection's outbound queue as the socket will take, handing up to SEND_BATCH frames
+// to each writev() call. While a file is being sent, only the frames queued ahead of it are sent. Returns 0
+// if the queue was sent or the socket would block, or -1 if the connection failed
+int FlushQueue(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	struct iovec iov[SEND_BATCH];
+	
+	while (stat->qLen > 0 && !(stat->isFileRequest && stat->nAhead == 0)) {
+		// Gather the queued frames, starting partway into the oldest frame if it was partially sent
+		int nIov = 0;
+		int nFrames = stat->isFileRequest ? stat->nAhead : stat->qLen;
+		for (int k=0; k<nFrames && k<SEND_BATCH; k++) {
+			struct FRAME * f = stat->sendQueue[(stat->qHead + k) % stat->qCap];
+			int offset = (k == 0) ? stat->qSent : 0;
+			iov[nIov].iov_base = f->data + offset;
+			iov[nIov].iov_len = f->len - offset;
+			nIov++;
+		}
+		
+		ssize_t n = writev(peers[i].fd, iov, nIov);
+		if (n < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				//The socket becomes non-writable. OS will notify us when we can write
+				peers[i].events |= POLLWRNORM;
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno == ECONNRESET || errno == EPIPE) {
+				return -1;
+			} else {
+				Log("Unexpected send error %d: %s", errno, strerror(errno));
+				exit(-1);
+			}
+		}
+		
+		stat->bytesOut += n;
+		STAT_ADD(bytesOut, n);
+		
+		// Release every frame that has now been sent completely
+		n += stat->qSent;
+		while (stat->qLen > 0) {
+			struct FRAME * f = stat->sendQueue[stat->qHead];
+			if (n < f->len) {
+				break;
+			}
+			n -= f->len;
+			ReleaseFrame(f);
+			stat->qHead = (stat->qHead + 1) % stat->qCap;
+			stat->qLen--;
+			STAT_ADD(sendQueued, -1);
+			if (stat->isFileRequest)
+				stat->nAhead--;
+		}
+		stat->qSent = n;
+	}
+	
+	// The reply being timed has gone out with the rest of the queue
+	if (stat->qLen == 0 && stat->replyStart != 0) {
+		RecordLatency(stat->replyType, stat->replyStart);
+		stat->replyStart = 0;
+	}
+	
+	peers[i].events &= ~POLLWRNORM;
+	return 0;
+}
+
+// Sends as much of the file a connection is downloading as the socket will take. The file goes from the page cache
+// to the socket with sendfile(), without being copied through the server's memory. Returns 1 once the whole file
+// has been sent, 0 if the socket would block, or -1 if the connection failed
+int SendFileData(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	
+	while (stat->sendOff < stat->nToSend) {
+		ssize_t n = sendfile(peers[i].fd, stat->sendFile->fd, &stat->sendOff, stat->nToSend - stat->sendOff);
+		if (n > 0) {
+			stat->bytesOut += n;
+			STAT_ADD(bytesOut, n);
+		}
+		else if (n < 0) {
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				//The socket becomes non-writable. OS will notify us when we can write
+				peers[i].events |= POLLWRNORM;
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno == ECONNRESET || errno == EPIPE) {
+				return -1;
+			} else {
+				Log("Unexpected sendfile error %d: %s", errno, strerror(errno));
+				exit(-1);
+			}
+		}
+		
+		// The file shrank since its size was taken, so the client could never receive all of it
+		if (n == 0) {
+			Log("File '%s' ended after %ld of %ld bytes.", stat->filename, (long)stat->sendOff, (long)stat->nToSend);
+			return -1;
+		}
+	}
+	
+	peers[i].events &= ~POLLWRNORM;
+	return 1;
+}
+
+// Queues the PUSHF command that starts the first file waiting to be pushed to a client
+void StartPush(int i) {
+	struct PUSH * p = connStat[i].pushHead;
+	connStat[i].pushOff = 0;
+	Log("SERVER pushing file '%s' (%ld bytes) from user '%s' to user '%s'.", p->file->filename, (long)p->file->size, p->sender, connStat[i].user);
+	SendCmd(i, PUSHF, "%u %s %ld %s", p->id, p->sender, (long)p->file->size, p->file->filename);
+}
+
+// Pushes a file from the file cache to a client over its own connection. The push holds a reference to the
+// cached file until all of it has been queued
+void PushFile(int i, struct CACHED_FILE * f, const char * sender) {
+	struct PUSH * p = (struct PUSH *)calloc(1, sizeof(struct PUSH));
+	if (p == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate a file push.");
+		exit(-1);
+	}
+	p->file = f;
+	p->id = ++connStat[i].pushID;
+	snprintf(p->sender, sizeof(p->sender), "%s", sender);
+	
+	// Files are pushed one at a time, in the order they were offered
+	if (connStat[i].pushHead == NULL) {
+		connStat[i].pushHead = p;
+		connStat[i].pushTail = p;
+		StartPush(i);
+		return;
+	}
+	connStat[i].pushTail->next = p;
+	connStat[i].pushTail = p;
+}
+
+// Queues the next chunk of the file being pushed to a client, and starts the next file once all of it has been queued.
+// A chunk is only queued once everything ahead of it has been sent, so commands for the client never wait behind
+// more than one chunk of a file
+void QueuePushChunk(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	struct PUSH * p = stat->pushHead;
+	int n = (p->file->size - stat->pushOff < PUSH_CHUNK) ? p->file->size - stat->pushOff : PUSH_CHUNK;
+	
+	if (n > 0) {
+		struct FRAME * f = NewFrame(FRAME_HDR_LEN + PUSH_ID_LEN + n);
+		BYTE * data = (BYTE *)f->data;
+		data[FRAME_HDR_LEN] = (BYTE)(p->id >> 24);
+		data[FRAME_HDR_LEN + 1] = (BYTE)(p->id >> 16);
+		data[FRAME_HDR_LEN + 2] = (BYTE)(p->id >> 8);
+		data[FRAME_HDR_LEN + 3] = (BYTE)p->id;
+		
+		// Compress the chunk straight from the cached file when the client can take it, unless that does not shrink it
+		int z = stat->compress ? CompressChunk((BYTE *)p->file->data + stat->pushOff, n, data + FRAME_HDR_LEN + PUSH_ID_LEN, n - 1) : -1;
+		if (z >= 0) {
+			PutFrameHeader(data, FILEZ, PUSH_ID_LEN + z);
+			f->len = FRAME_HDR_LEN + PUSH_ID_LEN + z;
+		}
+		else {
+			PutFrameHeader(data, FILEDATA, PUSH_ID_LEN + n);
+			memcpy(data + FRAME_HDR_LEN + PUSH_ID_LEN, p->file->data + stat->pushOff, n);
+		}
+		stat->pushOff += n;
+		QueueFrame(i, f);
+	}
+	if (stat->pushOff < p->file->size)
+		return;
+	
+	stat->pushHead = p->next;
+	CacheRelease(p->file);
+	free(p);
+	if (stat->pushHead != NULL)
+		StartPush(i);
+}
+
+// Returns the entry of the account table that holds the given username, or the empty entry where it would be added
+struct ACCOUNT * AccountSlot(struct ACCOUNT * table, int cap, const char * user) {
+	unsigned int k = HashName(user) & (cap - 1);
+	while (table[k].user[0] != '\0' && strcmp(table[k].user, user)) {
+		k = (k + 1) & (cap - 1);
+	}
+	return &table[k];
 }
 
-// Allows sockets to send in non-blocking mode by keeping track of the total amount of data sent
-int Send_NonBlocking(int sockFD, const BYTE * data, int len, struct CONN_STAT * pStat, struct pollfd * pPeer) {	
-	while (pStat->nSent < len) {
-		int n = send(sockFD, data + pStat->nSent, len - pStat->nSent, 0);
-		if (n >= 0) {
-			pStat->nSent += n;
-		} else if (n < 0 && (errno == ECONNRESET || errno == EPIPE)) {
-			close(sockFD);
-			return -1;
-		} else if (n < 0 && (errno == EWOULDBLOCK)) {
-			pPeer->events |= POLLWRNORM; 
-			return 0; 
-		} else {
-			Log("Unexpected send error %d: %s", errno, strerror(errno));
-			exit(-1);
-		}
-	}
-	pPeer->events &= ~POLLWRNORM;
-	return 0;
+// Returns the account with the given username, or NULL if there is none
+struct ACCOUNT * FindAccount(const char * user) {
+	if (nAccounts == 0)
+		return NULL;
+	struct ACCOUNT * acct = AccountSlot(accounts, accountCap, user);
+	return (acct->user[0] != '\0') ? acct : NULL;
 }
 
-// Allows sockets to send in non-blocking mode by keeping track of the total amount of data received
-int Recv_NonBlocking(int sockFD, BYTE * data, int len, struct CONN_STAT * pStat, struct pollfd * pPeer) {
-	while (pStat->nRecv < len) {
-		int n = recv(sockFD, data + pStat->nRecv, len - pStat->nRecv, 0);
-		if (n > 0) {
-			pStat->nRecv += n;
-		} else if (n == 0 || (n < 0 && errno == ECONNRESET)) {
-			close(sockFD);
-			return -1;
-		} else if (n < 0 && (errno == EWOULDBLOCK)) { 
-			return 0; 
-		} else {
-			Log("Unexpected recv error %d: %s.", errno, strerror(errno));
+// Adds an account to the account table, doubling the table once it is half full. An account that
+// already exists is left as it is. Returns the account's entry
+struct ACCOUNT * AddAccount(const char * user, const char * pass) {
+	if ((nAccounts + 1) * 2 > accountCap) {
+		int newCap = accountCap ? accountCap * 2 : 1024;
+		struct ACCOUNT * table = (struct ACCOUNT *)calloc(newCap, sizeof(struct ACCOUNT));
+		if (table == NULL) {
+			LogAt(LOG_ERROR, "Cannot grow account table to %d entries.", newCap);
 			exit(-1);
 		}
+		for (int k=0; k<accountCap; k++) {
+			if (accounts[k].user[0] != '\0')
+				*AccountSlot(table, newCap, accounts[k].user) = accounts[k];
+		}
+		free(accounts);
+		accounts = table;
+		accountCap = newCap;
 	}
 	
-	return 0;
+	struct ACCOUNT * acct = AccountSlot(accounts, accountCap, user);
+	if (acct->user[0] == '\0') {
+		snprintf(acct->user, sizeof(acct->user), "%s", user);
+		snprintf(acct->pass, sizeof(acct->pass), "%s", pass);
+		nAccounts++;
+	}
+	return acct;
 }
 
-// Sets a socket with a given file descriptor to non-blocking mode
-void SetNonBlockIO(int fd) {
-	int val = fcntl(fd, F_GETFL, 0);
-	if (fcntl(fd, F_SETFL, val | O_NONBLOCK) != 0) {
-		Log("Cannot set nonblocking I/O.");
+// Loads every account in the accounts file into the account table, and keeps the file open for appending new accounts.
+// Once this has run, registering and logging in never touch the disk apart from appending a registered account
+void LoadAccounts() {
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t n;
+	struct FIELDS f;
+	
+	if ((accountLog = fopen(ACCOUNT_FILE, "a+")) == NULL) {
+		LogAt(LOG_ERROR, "Cannot open %s.", ACCOUNT_FILE);
 		exit(-1);
 	}
+	
+	// Each line holds a username and password separated by a space. If a username appears twice, the first one is kept
+	while ((n = getline(&line, &len, accountLog)) != -1) {
+		SplitArgs(line, n, 2, &f);
+		if (f.n == 2)
+			AddAccount(f.at[0], f.at[1]);
+	}
+	free(line);
+	
+	Log("Loaded %d registered accounts.", nAccounts);
 }
 
-// Closes a socket and removes its structures from memory
-void RemoveConnection(int i) {
-	Log("Connection with client (ID %d) closed.", connStat[i].ID);
-	close(peers[i].fd);	
-	if (i < nConns) {	
-		memmove(peers + i, peers + i + 1, (nConns-i) * sizeof(struct pollfd));
-		memmove(connStat + i, connStat + i + 1, (nConns-i) * sizeof(struct CONN_STAT));
-	}
-	nConns--;
+// Finds the username and password in the fields of a REGISTER or LOGIN command. Returns -1 if either one is
+// missing or too long to be valid
+int ParseCredentials(struct FIELDS * f, char ** username, char ** password) {
+	if (f->n < 2 || f->len[0] > MAX_CRED || f->len[1] > MAX_CRED)
+		return -1;
+	*username = f->at[0];
+	*password = f->at[1];
+	return 0;
 }
 
 // registers a user and saves it to the database text file
-void reg(struct CONN_STAT * stat, int i, char * credentials) {
-	int fd = peers[i].fd;
-	char *line = (char *)malloc(sizeof(char) * CMD_LEN);
-	size_t len;
-	char username[64];
-	char password[64];
-			
-	// parse for username and password
-	char *parse = strtok(credentials, " ");
-	sprintf(username, "%s", parse);
-	parse = strtok(NULL, " ");
-	sprintf(password, "%s", parse);
-	
-	int uLen = strlen(username);
-	int pLen = strlen(password) - 1; // Accounting for newline from command
-	
-	// Checking if the username and password are valid sizes
-	if (uLen < MIN_CRED || uLen > MAX_CRED || pLen < MIN_CRED || pLen > MAX_CRED) {
-		sprintf(stat->dataSend, "ERROR Credentials are of invalid size (must be between 4 and 8 characters). Username is %d characters and password is %d characters.", uLen, pLen);
+void reg(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char *username, *password;
+	
+	// parse for username and password, checking that they are valid sizes
+	if (ParseCredentials(f, &username, &password) < 0 || f->len[0] < MIN_CRED || f->len[1] < MIN_CRED) {
+		SendCmd(i, ERROR, "Credentials are of invalid size (must be between %d and %d characters).", MIN_CRED, MAX_CRED);
 		Log("User attempted to register accound with credentials of invalid length.");
-		
-		stat->nCmdRecv = 0;
-				
-		stat->nToSend = CMD_LEN;
-		if (Send_NonBlocking(fd, stat->dataSend, stat->nToSend, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == stat->nToSend) {
-			stat->nSent = 0;
-			stat->nToSend = 0;
-			return;
-		}
-		
 		return;
 	}
 	
-	// Open the account file and check if there is already an account with the target username
-	FILE *accts;
-	accts = fopen("registered_accounts.txt", "a+");
-	while(getline(&line, &len, accts) != -1) {
-		parse = strtok(line, " ");
-		
-		// If there is already an account with a matching name send an error
-		if (!strcmp(parse, username)) {
-			sprintf(stat->dataSend, "ERROR User already exists with username '%s'. Please choose a new username.", username);
-			Log("User attempted to register an account with a username that already exists in the database.");
-					
-			stat->nToSend = CMD_LEN;
-			if (Send_NonBlocking(fd, stat->dataSend, stat->nToSend, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == stat->nToSend) {
-				stat->nSent = 0;
-				stat->nToSend = 0;
-				return;
-			}
-			
-			return;
-		}
+	// If there is already an account with a matching name send an error
+	pthread_mutex_lock(&accountLock);
+	if (FindAccount(username) != NULL) {
+		pthread_mutex_unlock(&accountLock);
+		SendCmd(i, ERROR, "User already exists with username '%s'. Please choose a new username.", username);
+		Log("User attempted to register an account with a username that already exists in the database.");
+		return;
 	}
 	
-	// Save the username and password of the new account to the accounts file, then close it and free the line buffer
-	fprintf(accts, "%s %s", username, password);
-	fclose(accts);
-	free(line);
+	// Add the account, and have the I/O threads append its username and password to the accounts file
+	AddAccount(username, password);
+	pthread_mutex_unlock(&accountLock);
 	
-	// Format a success message and send it back to the client
-	sprintf(stat->dataSend, "PRINT User '%s' registered successfully.", username);
-	Log("User successfully registered an account with username '%s'.", username);
+	struct IO_JOB * job = NewJob(IO_APPEND, "");
+	job->fd = fileno(accountLog);
+	job->len = asprintf(&job->buf, "%s %s\n", username, password);
+	SubmitIO(job);
 	
-	// Initiate sending the success message back to the client
-	stat->nToSend = CMD_LEN;
-	if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-		stat->nSent = 0;
-		stat->nToSend = 0;
-		return;
-	}
+	// Send a success message back to the client
+	SendCmd(i, PRINT, "User '%s' registered successfully.", username);
+	Log("User successfully registered an account with username '%s'.", username);
 }
 
 // logs a user in
-void login(struct CONN_STAT * stat, int i, char * credentials) {
-	int fd = peers[i].fd;
-	int logCheck = 0;
-	char *line = (char *)malloc(sizeof(char) * 18);
-	size_t len;
-	char username[8];
-	char password[9];
+void login(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char *username, *password;
 	
 	// Make sure the client does not attempt to log in as another user while they are already logged in
 	if (stat->loggedIn) {
-		sprintf(stat->dataSend, "ERROR You are already logged in as '%s'.", stat->user);
+		SendCmd(i, ERROR, "You are already logged in as '%s'.", stat->user);
 		Log("User '%s' tried to log in to another account while already logged in.", stat->user);
-		
-		stat->nToSend = CMD_LEN;
-		if (Send_NonBlocking(peers[i].fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-			stat->nSent = 0;
-			stat->nToSend = 0;
-			return;
-		}
-	}
-			
-	// parse for username and password
-	char *parse = strtok(credentials, " ");
-	sprintf(username, "%s", parse);
-	parse = strtok(NULL, " ");
-	sprintf(password, "%s", parse);
-	
-	// Open the accounts file to check if the user exists
-	FILE *accts;
-	if((accts = fopen("registered_accounts.txt", "r")) == NULL) {
-		// If the file fails to open, this almost certainly means the file hasn't been created yet
-		// This happens only when the first user to create an account chosses a prohibited username
-		Log("Failed to open registered_accounts.txt. Did the user choose a prohibited username?");
-		sprintf(stat->dataSend, "ERROR User '%s' does not exist. Please register an account first.", username);
-		stat->nToSend = CMD_LEN;
-		if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-			stat->nSent = 0;
-			stat->nToSend = 0;
-			return;
-		}
 		return;
 	}
 	
-	// Iterate through all accounts to find matching account
-	while(getline(&line, &len, accts) != -1) {
-		parse = strtok(line, " ");
-		if (!strcmp(parse, username)) {
-			// Check if user is already logged in
-			for (int j=1; j<=nConns; j++) {
-				if (!strcmp(username, connStat[j].user)) {
-					logCheck = 1;
-					sprintf(stat->dataSend, "ERROR User '%s' is already logged in.", username);
-					Log("User attempted to log in as a user that is currently logged in (%s).", username);
-					break;
-				}
-			}
-			if (logCheck) {
-				break;
-			}
-			
-			// Check to make sure the correct password was supplied. If it was, store username and set state to logged in
-			parse = strtok(NULL, " ");
-			if (!strcmp(parse, password)) {
-				// Relay that the user has logged in to all other online users
-				for (int j=1; j<=nConns; j++) {
-					if (connStat[j].loggedIn) {
-						sprintf(connStat[j].dataSend, "PRINT '%s' has logged in.", username);
-						connStat[j].nToSend = CMD_LEN;
-						if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-							connStat[j].nSent = 0;
-							connStat[j].nToSend = 0;
-						}
-					}
-				}	
-			
-				// Log in the user
-				strcpy(stat->user, username);
-				stat->loggedIn = 1;
-				sprintf(stat->dataSend, "LOGIN %s", username);
-				Log("User '%s' has successfully logged in.", username);
-				break;
-			}
+	// parse for username and password, and find the matching account
+	int found = 0;
+	char accountPass[MAX_CRED + 1];
+	if (ParseCredentials(f, &username, &password) == 0) {
+		pthread_mutex_lock(&accountLock);
+		struct ACCOUNT * acct = FindAccount(username);
+		if (acct != NULL) {
+			found = 1;
+			strcpy(accountPass, acct->pass);
 		}
+		pthread_mutex_unlock(&accountLock);
 	}
-	if (!stat->loggedIn && !logCheck) {
-		sprintf(stat->dataSend, "ERROR Invalid user credentials.");
-		Log("User provided invalid password for account '%s'.", username);
+	if (!found) {
+		SendCmd(i, ERROR, "Invalid user credentials.");
+		Log("User attempted to log in to an account that does not exist.");
+		return;
 	}
 	
-	// Close the accounts file and free the line buffer
-	fclose(accts);
-	free(line);
+	// Check to make sure the correct password was supplied
+	if (strcmp(accountPass, password)) {
+		SendCmd(i, ERROR, "Invalid user credentials.");
+		Log("User provided invalid password for account '%s'.", username);
+		return;
+	}
 	
-	// Send the appropriate message back to the client
-	stat->nToSend = CMD_LEN;
-	if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-		stat->nSent = 0;
-		stat->nToSend = 0;
+	// Claim the username in the online user index, which fails if the user is already logged in
+	if (SetOnline(i, username) < 0) {
+		SendCmd(i, ERROR, "User '%s' is already logged in.", username);
+		Log("User attempted to log in as a user that is currently logged in (%s).", username);
 		return;
 	}
+	
+	// Relay that the user has logged in to all other online users
+	BroadcastCmd(PRINT, "'%s' has logged in.", username);
+	
+	// Log in the user
+	strcpy(stat->user, username);
+	stat->loggedIn = 1;
+	SendCmd(i, LOGIN, "%s", username);
+	Log("User '%s' has successfully logged in.", username);
 }
 
 // logs a user out
 void logout(struct CONN_STAT * stat, int i) {
 	// Make sure the user is logged in first before logging them out, otherwise return an error message
 	if (stat->loggedIn) {
-		sprintf(stat->dataSend, "LOGOUT\n");
+		SendCmd(i, LOGOUT, NULL);
 		Log("User '%s' successfully logged out.", stat->user);
-		memset(stat->user, 0, 8);
+		LeaveChannels(i);
+		ClearOnline(i);
+		memset(stat->user, 0, sizeof(stat->user));
 		stat->loggedIn = 0;
 	}
 	else {
-		sprintf(stat->dataSend, "ERROR Cannot log out, you are not logged in.");
+		SendCmd(i, ERROR, "Cannot log out, you are not logged in.");
 		Log("User attempted to log out while already logged out.");
 	}
-	
-	// Send the response message back to the client
-	stat->nToSend = CMD_LEN;
-	if (Send_NonBlocking(peers[i].fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-		stat->nSent = 0;
-		stat->nToSend = 0;
-		return;
-	}
 }
 
 // sends a message of a certain type based on the command received
-void msg(int sel, struct CONN_STAT * stat, int i, char * msg) {
-	int fd = peers[i].fd;
-	
-	// Remove the newline character from the input script if it exists for formatting purposes
-	int last = strlen(msg);
-	if (msg[last-1] == '\n') {
-		msg[last-1] = '\0';
-	}
+void msg(int sel, struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	// Public messages are the only field. Private ones start with the target user, and the message is the rest
+	char *msg = (f->n > 0) ? f->at[0] : "";
+	char *target = msg;
+	char *sepMsg = (f->n > 1) ? f->at[1] : "";
 	
 	// If not logged in, then do not allow message to be sent
 	if (!stat->loggedIn) {
-		sprintf(stat->dataSend, "ERROR Cannot send message, you are not logged in.");
+		SendCmd(i, ERROR, "Cannot send message, you are not logged in.");
 		Log("User attempted to send a message while logged out.");
-		stat->nToSend = CMD_LEN;
-		if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-			stat->nSent = 0;
-			stat->nToSend = 0;
-		}
 		return;
 	}
 	
 	// Based on the type of message, format the message and send it to the appropriate recipients (sender is included for messages)
 	switch (sel) {
 		case SEND: {
-			char * msgSend = (char *)malloc(sizeof(char) * CMD_LEN);
-			sprintf(msgSend, "PRINT %s: %s", stat->user, msg);
-			for (int j=1; j<=nConns; j++) {
-				// Send the message to all online users
-				if (connStat[j].loggedIn) {
-					Log("SERVER sending public message (%s->%s) - %s", stat->user, connStat[j].user, msg);
-					strcpy(connStat[j].dataSend, msgSend);
-					
-					connStat[j].nToSend = CMD_LEN;
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						connStat[j].nSent = 0;
-						connStat[j].nToSend = 0;
-					}
-				}
-			}
-			free(msgSend);
+			// Send the message to all online users
+			LogAt(LOG_DEBUG, "SERVER sending public message (%s->all) - %s", stat->user, msg);
+			BroadcastCmd(PRINT, "%s: %s", stat->user, msg);
 			break;
 		}
 		case SEND2: {
-			char *target = strtok(msg, " ");
-			char *sepMsg = strtok(NULL, "");
-			int userOnline = 0;
-			
 			// If the user is attempting to send a private message to themselves, send an error message
 			if (!strcmp(stat->user, target)) {
-				sprintf(stat->dataSend, "ERROR You are attempting to send a private message to yourself.");
+				SendCmd(i, ERROR, "You are attempting to send a private message to yourself.");
 				Log("User '%s' attempted to send a private message to themselves.", stat->user);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
 				break;
 			}
 			
-			// Search through all connections to find the target user
-			for (int j=1; j<=nConns; j++) {
-				// If the user is online, send them the private message
-				if (connStat[j].loggedIn && !strcmp(target, connStat[j].user)) {
-					userOnline = 1;
-					sprintf(connStat[j].dataSend, "PRINT [%s->you]: %s", stat->user, sepMsg);
-					Log("SERVER sending private message (%s->%s) - %s", stat->user, target, sepMsg);
-					connStat[j].nToSend = CMD_LEN;
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						connStat[j].nSent = 0;
-						connStat[j].nToSend = 0;
-					}
-				}
+			// If the target user is online, send them the private message
+			conn_handle h;
+			int isOnline = FindOnline(target, &h);
+			if (isOnline) {
+				DeliverCmd(h, PRINT, "[%s->you]: %s", stat->user, sepMsg);
+				LogAt(LOG_DEBUG, "SERVER sending private message (%s->%s) - %s", stat->user, target, sepMsg);
 			}
 			
 			// Send the sender the appropriate message based on if the target is online
-			if (userOnline) {
-				sprintf(stat->dataSend, "PRINT [you->%s]: %s", target, sepMsg);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
+			if (isOnline) {
+				SendCmd(i, PRINT, "[you->%s]: %s", target, sepMsg);
 			}
 			else {
-				sprintf(stat->dataSend, "ERROR Cannot send message, user '%s' is not online.", target);
+				SendCmd(i, ERROR, "Cannot send message, user '%s' is not online.", target);
 				Log("User '%s' tried to send a private message to a user (%s) that is not logged in.", stat->user, target);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
 			}
 			break;
 		}
 		case SENDA: {
-			char * msgSend = (char *)malloc(sizeof(char) * CMD_LEN);
-			sprintf(msgSend, "PRINT ******: %s", msg);
-			for (int j=1; j<=nConns; j++) {
-				// Send the anonymous message to all online users
-				if (connStat[j].loggedIn) {
-					strcpy(connStat[j].dataSend, msgSend);
-					Log("SERVER sending anonymous public message (%s->%s) - %s", stat->user, connStat[j].user, msg);
-					connStat[j].nToSend = CMD_LEN;
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						connStat[j].nSent = 0;
-						connStat[j].nToSend = 0;
-					}
-				}
-			}
-			
-			free(msgSend);
+			// Send the anonymous message to all online users
+			BroadcastCmd(PRINT, "******: %s", msg);
+			LogAt(LOG_DEBUG, "SERVER sending anonymous public message (%s->all) - %s", stat->user, msg);
 			break;
 		}
 		case SENDA2: {
-			char *target = strtok(msg, " ");
-			char *sepMsg = strtok(NULL, "");
-			int userOnline = 0;
-			
 			// If the user is attempting to send a private message to themselves, send an error message
 			if (!strcmp(stat->user, target)) {
-				sprintf(stat->dataSend, "ERROR You are attempting to send a private message to yourself.");
+				SendCmd(i, ERROR, "You are attempting to send a private message to yourself.");
 				Log("User '%s' attempted to send a private message to themselves.", stat->user);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
 				break;
 			}
 			
-			// Search through all connections to find the target user
-			for (int j=1; j<=nConns; j++) {
-				// If the user is online, send them the anonymous private message
-				if (connStat[j].loggedIn && !strcmp(target, connStat[j].user)) {
-					userOnline = 1;
-					sprintf(connStat[j].dataSend, "PRINT [******->you]: %s", sepMsg);
-					Log("SERVER sending private anonymous message (%s->%s) - %s", stat->user, target, sepMsg);
-					connStat[j].nToSend = CMD_LEN;
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						connStat[j].nSent = 0;
-						connStat[j].nToSend = 0;
-					}
-				}
+			// If the target user is online, send them the anonymous private message
+			conn_handle h;
+			int isOnline = FindOnline(target, &h);
+			if (isOnline) {
+				DeliverCmd(h, PRINT, "[******->you]: %s", sepMsg);
+				LogAt(LOG_DEBUG, "SERVER sending private anonymous message (%s->%s) - %s", stat->user, target, sepMsg);
 			}
 			
 			// Send the sender the appropriate message based on if the target is online
-			if (userOnline) {
-				sprintf(stat->dataSend, "PRINT [(you)->%s]: %s", target, sepMsg);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
+			if (isOnline) {
+				SendCmd(i, PRINT, "[(you)->%s]: %s", target, sepMsg);
 			}
 			else {
-				sprintf(stat->dataSend, "ERROR Cannot send message, user '%s' is not online.", target);
+				SendCmd(i, ERROR, "Cannot send message, user '%s' is not online.", target);
 				Log("User '%s' tried to send a private message to a user (%s) that is not logged in.", stat->user, target);
-				stat->nToSend = CMD_LEN;
-				if (Send_NonBlocking(fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-					stat->nSent = 0;
-					stat->nToSend = 0;
-				}
 			}
 			break;
 		}
 	}
 }
 
+// Returns the channel a field names, without the '#' it may start with, or NULL if it is not a valid channel name
+char * ChannelName(struct FIELDS * f) {
+	if (f->n < 1)
+		return NULL;
+	char * name = f->at[0] + (f->at[0][0] == '#');
+	int len = strlen(name);
+	if (len == 0 || len > MAX_CHANNEL_NAME || strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_") != len)
+		return NULL;
+	return name;
+}
+
+// Returns the index in a user's joined channels of the named channel, or -1 if the user is not in it
+int FindJoined(struct CONN_STAT * stat, const char * name) {
+	for (int k=0; k<stat->nJoined; k++) {
+		if (!strcmp(stat->joined[k]->name, name))
+			return k;
+	}
+	return -1;
+}
+
+// adds a user to a channel, creating the channel if it does not exist yet
+void join(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char * name = ChannelName(f);
+	if (!stat->loggedIn) {
+		SendCmd(i, ERROR, "Cannot join a channel, you are not logged in.");
+		return;
+	}
+	if (name == NULL) {
+		SendCmd(i, ERROR, "Channel names are 1 to %d letters, digits, '-' or '_'.", MAX_CHANNEL_NAME);
+		return;
+	}
+	if (FindJoined(stat, name) >= 0) {
+		SendCmd(i, ERROR, "You are already in channel '#%s'.", name);
+		return;
+	}
+	if (stat->nJoined == MAX_JOINED) {
+		SendCmd(i, ERROR, "You cannot be in more than %d channels.", MAX_JOINED);
+		return;
+	}
+	
+	pthread_mutex_lock(&channelLock);
+	struct CHANNEL * c = ChannelSlot(name);
+	if (c->name[0] == '\0') {
+		if (nChannels == MAX_CHANNELS) {
+			pthread_mutex_unlock(&channelLock);
+			SendCmd(i, ERROR, "Cannot create channel '#%s', the server has no room for more channels.", name);
+			Log("User '%s' could not create channel '#%s' because the channel table is full.", stat->user, name);
+			return;
+		}
+		if ((c->members = (struct HANDLE_LIST *)calloc(nReactors, sizeof(struct HANDLE_LIST))) == NULL) {
+			LogAt(LOG_ERROR, "Cannot allocate the members of channel '#%s'.", name);
+			exit(-1);
+		}
+		strcpy(c->name, name);
+		nChannels++;
+	}
+	PushHandle(&c->members[reactorID], HANDLE(i));
+	int nMembers = ++c->nMembers;
+	pthread_mutex_unlock(&channelLock);
+	stat->joined[stat->nJoined++] = c;
+	
+	// Tell the channel, the new member included, who has joined
+	ChannelCmd(c, PRINT, "[#%s] '%s' has joined (%d members).", c->name, stat->user, nMembers);
+	Log("User '%s' joined channel '#%s'.", stat->user, c->name);
+}
+
+// takes a user out of a channel
+void part(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char * name = ChannelName(f);
+	int k = (stat->loggedIn && name != NULL) ? FindJoined(stat, name) : -1;
+	if (k < 0) {
+		SendCmd(i, ERROR, "Cannot leave channel '#%s', you are not in it.", name != NULL ? name : "");
+		return;
+	}
+	
+	// The members are told before the user leaves, so the user gets the notice too
+	struct CHANNEL * c = stat->joined[k];
+	ChannelCmd(c, PRINT, "[#%s] '%s' has left.", c->name, stat->user);
+	pthread_mutex_lock(&channelLock);
+	RemoveMember(c, HANDLE(i));
+	pthread_mutex_unlock(&channelLock);
+	stat->joined[k] = stat->joined[--stat->nJoined];
+	Log("User '%s' left channel '#%s'.", stat->user, c->name);
+}
+
+// sends a message to the members of a channel the sender is in
+void sendc(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char * name = ChannelName(f);
+	int k = (stat->loggedIn && name != NULL) ? FindJoined(stat, name) : -1;
+	if (k < 0) {
+		SendCmd(i, ERROR, "Cannot send message, you are not in channel '#%s'.", name != NULL ? name : "");
+		return;
+	}
+	
+	struct CHANNEL * c = stat->joined[k];
+	char * text = (f->n > 1) ? f->at[1] : "";
+	LogAt(LOG_DEBUG, "SERVER sending channel message (%s->#%s) - %s", stat->user, c->name, text);
+	ChannelCmd(c, PRINT, "[#%s] %s: %s", c->name, stat->user, text);
+}
+
+// Orders online users by the ID of their connection
+int CompareOnline(const void * a, const void * b) {
+	return ((const struct ONLINE_USER *)a)->ID - ((const struct ONLINE_USER *)b)->ID;
+}
+
 // lists all users that are online
 void list(struct CONN_STAT * stat, int i) {
-	char msgResp[CMD_LEN];
-	memset(msgResp, 0, CMD_LEN);
+	char msgResp[MAX_BODY_LEN + 1];
+	int len = 0;
+	msgResp[0] = '\0';
 	
 	// Make sure the user is logged in before allowing the server to send the online user list
 	if (!stat->loggedIn) {
-		sprintf(stat->dataSend, "ERROR Cannot send list of users, you are not logged in.");
+		SendCmd(i, ERROR, "Cannot send list of users, you are not logged in.");
 		Log("User requested the list of online users, but is not logged in.");
-		stat->nToSend = CMD_LEN;
-		if (Send_NonBlocking(peers[i].fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-			stat->nSent = 0;
-			stat->nToSend = 0;
-			return;
-		}
-		
 		return;
 	}
 	
-	// Iterate through all open connections for logged in users
-	for (int j=1; j<=nConns; j++) {
-		if (connStat[j].loggedIn) {
-			char userFormatted[11];
-			
-			// If the user is logged in, add then to the formatted list
-			if (strlen(msgResp) == 0)
-				sprintf(userFormatted, "%s", connStat[j].user);
-			else
-				sprintf(userFormatted, ", %s", connStat[j].user);
-				
-			strcat(msgResp, userFormatted);
-		}
+	// Copy the users out of the online user index, which holds the users logged in on every reactor,
+	// and list them in the order their connections were made
+	struct ONLINE_USER * users = (struct ONLINE_USER *)malloc(sizeof(struct ONLINE_USER) * onlineCap);
+	int nUsers = 0;
+	if (users == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate the list of online users.");
+		exit(-1);
+	}
+	pthread_mutex_lock(&onlineLock);
+	for (int k=0; k<onlineCap; k++) {
+		if (online[k].user[0] != '\0')
+			users[nUsers++] = online[k];
 	}
+	pthread_mutex_unlock(&onlineLock);
+	qsort(users, nUsers, sizeof(struct ONLINE_USER), CompareOnline);
 	
-	// Save the formatted userlist in the send buffer and send it back to the client
-	sprintf(stat->dataSend, "PRINT Users online: %s", msgResp);
-	Log("User '%s' requested the list of online users. Server responding with '%s'.", stat->user, msgResp);
-	stat->nToSend = CMD_LEN;
-	if (Send_NonBlocking(peers[i].fd, stat->dataSend, CMD_LEN, stat, &peers[i]) < 0 || stat->nSent == CMD_LEN) {
-		stat->nSent = 0;
-		stat->nToSend = 0;
-		return;
+	// Add each user to the formatted list. The list stops growing once it fills the largest body a frame can carry
+	for (int k=0; k<nUsers && len < MAX_BODY_LEN; k++) {
+		len += snprintf(msgResp + len, sizeof(msgResp) - len, (len == 0) ? "%s" : ", %s", users[k].user);
 	}
+	free(users);
+	
+	// Send the formatted userlist back to the client
+	SendCmd(i, PRINT, "Users online: %s", msgResp);
+	Log("User '%s' requested the list of online users. Server responding with '%s'.", stat->user, msgResp);
 }	
 
-// allows the server to receive a file from a client, save it to the server directory,
-// and send file send requests to all online users
-void recvf(struct CONN_STAT * stat, int i) {
-	// Receive and save the file
-	if (stat->nRecv < stat->nToRecv) {
-		if (Recv_NonBlocking(peers[i].fd, stat->file, stat->nToRecv, stat, &peers[i]) < 0) {
-			RemoveConnection(i);
+// Offers an uploaded file to a logged in user. Clients that asked for files to be pushed get the file over their own
+// connection straight from the file cache, while other clients are sent a LISTEN command so they request the file
+void OfferFile(int j, const char * fileUser, const char * filename) {
+	if (connStat[j].push) {
+		struct CACHED_FILE * f = CacheFind(filename);
+		if (f != NULL) {
+			PushFile(j, f, fileUser);
 			return;
 		}
-		if (stat->nRecv == stat->nToRecv) {
-			stat->nRecv = 0;
-			stat->nCmdRecv = 0;
-			FILE * newFile; 
-			
-			// Open (create or replace) file with same filename on client-side
-			if ((newFile = fopen(connStat[i].filename, "w")) == NULL) {
-				Log("Server received file from user '%s' but cannot create file '%s' in directory. Closing connection.", connStat[i].fileUser, connStat[i].filename);
-				RemoveConnection(i);
-				return;
-			}
-			
-			// Write the data into the file
-			int n;
-			if ((n = fwrite(connStat[i].file, sizeof(char), connStat[i].nToRecv, newFile)) < connStat[i].nToRecv) {
-				Log("Incorrect number of bytes (%d/%d) written to file '%s'. Closing connection.", n, connStat[i].nToRecv, connStat[i].filename);
-				RemoveConnection(i);
-				return;
-			}
-			Log("SERVER received file '%s' (%d bytes) from user '%s'.", connStat[i].filename, connStat[i].nToRecv, connStat[i].fileUser);
-			
-			// Free the allocated memory for the file and close the file pointer
-			free(connStat[i].file);
-			fclose(newFile);
-			
-			// Send a LISTEN command back to the clients in order to request a new data connection to be made for file transfer
-			// Do not send file back to sender
-			for (int j=1; j<=nConns; j++) {
-				connStat[j].nToSend = CMD_LEN;
-				if (connStat[j].loggedIn && strcmp(connStat[j].user, connStat[i].fileUser)) {
-					sprintf(connStat[j].dataSend, "LISTEN %s %s %s", connStat[i].fileUser, connStat[j].user, connStat[i].filename);
-					strcpy(connStat[j].filename, connStat[i].filename);
-					Log("SERVER sending command for user '%s' to request the file '%s' from '%s'.", connStat[j].user, connStat[i].filename, connStat[i].fileUser);
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						stat->nSent = 0;
-						stat->nToSend = 0;
-					}
-				}
-			}
-			
-			// After queueing messages to send to logged in clients, close this helper socket
-			RemoveConnection(i);
-		}
 	}
+	SendCmd(j, LISTEN, "%s %s %s", fileUser, connStat[j].user, filename);
+	Log("SERVER sending command for user '%s' to request the file '%s' from '%s'.", connStat[j].user, filename, fileUser);
 }
 
-// allows the server to receive a file from a client, save it to the server directory,
-// and send file send requests to one single specified user
-void recvf4(struct CONN_STAT * stat, int i) {
-	// Receive and save the file
-	if (stat->nRecv < stat->nToRecv) {
-		if (Recv_NonBlocking(peers[i].fd, stat->file, stat->nToRecv, stat, &peers[i]) < 0) {
-			RemoveConnection(i);
-			return;
+// Offers an uploaded file to the connection h, or to every user logged in on this reactor apart from the one who
+// uploaded the file if h is 0. body holds the uploader's name and the filename
+void AnnounceFile(conn_handle h, char * body) {
+	char * fileUser = body;
+	char * filename = strchr(body, ' ');
+	if (filename == NULL)
+		return;
+	*filename++ = '\0';
+	
+	if (h != 0) {
+		int j = HandleToConn(h);
+		if (j >= 0 && connStat[j].loggedIn)
+			OfferFile(j, fileUser, filename);
+		return;
+	}
+	for (int j=FIRST_SLOT; j<connHigh; j++) {
+		if (connStat[j].loggedIn && strcmp(connStat[j].user, fileUser)) {
+			OfferFile(j, fileUser, filename);
 		}
-		if (stat->nRecv == stat->nToRecv) {
-			stat->nRecv = 0;
-			stat->nCmdRecv = 0;
-			FILE * newFile; 
-			
-			// Open (create or replace) file with same filename on client-side
-			if ((newFile = fopen(connStat[i].filename, "w")) == NULL) {
-				Log("Server received file from user '%s' but cannot create file '%s' in directory. Closing connection.", connStat[i].fileUser, connStat[i].filename);
-				RemoveConnection(i);
-			}
-			
-			// Write the data into the file
-			int n;
-			if ((n = fwrite(connStat[i].file, sizeof(char), connStat[i].nToRecv, newFile)) < connStat[i].nToRecv) {
-				Log("Incorrect number of bytes (%d/%d) written to file '%s'. Closing connection.", n, connStat[i].nToRecv, connStat[i].filename);
-				RemoveConnection(i);
-				return;
-			}
-			Log("SERVER received file '%s' (%d bytes) from user '%s'.", connStat[i].filename, connStat[i].nToRecv, connStat[i].fileUser);
-			
-			// Free the allocated memory for the file and close the file pointer
-			free(connStat[i].file);
-			fclose(newFile);
-			
-			// Send a LISTEN command back to the target client only in order to request a new data connection to be made for file transfer
-			for (int j=1; j<=nConns; j++) {
-				connStat[j].nToSend = CMD_LEN;
-				if (connStat[j].loggedIn && !strcmp(connStat[j].user, connStat[i].fileRecip) && strcmp(connStat[j].user, connStat[i].fileUser)) {
-					sprintf(connStat[j].dataSend, "LISTEN %s %s %s", connStat[i].fileUser, connStat[i].fileRecip, connStat[i].filename);
-					strcpy(connStat[j].filename, connStat[i].filename);
-					Log("SERVER sending command for user '%s' to request the file '%s' from '%s'.", connStat[j].user, connStat[i].filename, connStat[i].fileUser);
-					if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-						stat->nSent = 0;
-						stat->nToSend = 0;
-					}
-				}
-			}
-			
-			// After queueing messages to send to logged in clients, close this helper socket
-			RemoveConnection(i);
+	}
+}
+
+// allows the server to receive a file from a client and save it to the server directory. Used for both RECVF
+// and RECVF4, which only differ in who is asked to request the file once it has been saved
+void recvf(struct CONN_STAT * stat, int i) {
+	// Receive the next part of the file, and hand whatever is ready to the I/O threads
+	if (RecvUpload(i) < 0) {
+		Log("Failed to receive file '%s' from user '%s' (%ld/%ld bytes). Closing connection.", stat->filename, stat->fileUser, (long)(stat->fileOff + stat->nFile), (long)stat->nToRecv);
+		RemoveConnection(i);
+		return;
+	}
+	PumpUpload(i);
+}
+
+// Sends file send requests for a file that has been saved to the server directory. Files uploaded with RECVF are
+// offered to all online users, while files uploaded with RECVF4 are only offered to the user they were sent to
+void AnnounceUpload(struct IO_JOB * job) {
+	char body[MAX_FILENAME + MAX_CRED + 2];
+	int len = snprintf(body, sizeof(body), "%s %s", job->user, job->filename);
+	
+	if (job->msg == RECVF) {
+		// Offer the file to every client, either by pushing it or with a LISTEN command asking for a new data connection
+		// to be made for file transfer. Each reactor offers it to its own users
+		for (int r=0; r<nReactors; r++) {
+			if (r != reactorID)
+				PostMail(r, MAIL_FILE, 0, LISTEN, body, len);
 		}
+		AnnounceFile(0, body);
+		return;
+	}
+	
+	// Offer the file to the target client only, on the reactor that owns its connection
+	conn_handle h;
+	if (FindOnline(job->recip, &h) && strcmp(job->recip, job->user)) {
+		if (HANDLE_REACTOR(h) != reactorID)
+			PostMail(HANDLE_REACTOR(h), MAIL_FILE, h, LISTEN, body, len);
+		else
+			AnnounceFile(h, body);
 	}
 }
 
-// sends a file from the server to one client
-void sendf(struct CONN_STAT * stat, int i, char * listen) {
-	// Let the server know this socket will be sending a file
+// Starts sending a file from the file cache to a client. The download holds a reference to the cached file until it is done
+void StartDownload(struct CONN_STAT * stat, int i, struct CACHED_FILE * f, const char * sender, const char * receiver, off_t offset) {
+	stat->sendFile = f;
+	stat->nToSend = f->size;
+	
+	// Let the server know this socket will be sending a file. A resumed download starts where the client's copy
+	// ends, unless that is past the end of the file, in which case the whole file is sent again
+	stat->sendOff = offset <= f->size ? offset : 0;
 	stat->isFileRequest = 1;
+	stat->nAhead = stat->qLen;
+	
+	// Queue the command for the client to receive the file. The file itself is sent with sendfile() once the
+	// command and anything queued before it have been sent
+	Log("SERVER sending file '%s' (%ld bytes) from user '%s' to user '%s'.", stat->filename, (long)stat->nToSend, sender, receiver);
+	if (stat->sendOff > 0)
+		SendCmd(i, RECV, "%ld:%ld %s", (long)stat->nToSend, (long)stat->sendOff, stat->filename);
+	else
+		SendCmd(i, RECV, "%ld %s", (long)stat->nToSend, stat->filename);
+	stat->nAhead++;
+}
+
+// Returns 1 if a client may upload or download a file under the given name. Files are kept in the server directory,
+// so a name may not lead anywhere else, be too long to keep whole, or be one of the server's own files: the file store,
+// the accounts file, or the partial file of an upload in progress
+int ValidFilename(const char * name) {
+	int len = strlen(name);
+	return len > 0 && len < MAX_FILENAME && strchr(name, '/') == NULL && strstr(name, "..") == NULL && strcmp(name, STORE_DIR) != 0
+		&& strcmp(name, ACCOUNT_FILE) != 0 && (len < 5 || strcmp(name + len - 5, ".part") != 0);
+}
+
+// Tells a client why its file transfer was refused and closes the connection. The ERROR is sent straight away, since
+// closing the connection drops anything still queued for it
+void RefuseTransfer(int i, const char * format, ...) {
+	char body[MAX_BODY_LEN + 1];
+	va_list argptr;
+	va_start(argptr, format);
+	int len = FormatBody(body, format, argptr);
+	va_end(argptr);
+	
+	Log("Client (ID %d) file transfer refused: %s Closing connection.", connStat[i].ID, body);
+	QueueCmd(i, ERROR, body, len);
+	FlushQueue(i);
+	RemoveConnection(i);
+}
+
+// sends a file from the server to one client
+void sendf(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	// A connection downloads one file at a time
+	if (stat->isFileRequest || stat->ioBusy) {
+		Log("Client (ID %d) requested a file while still receiving '%s'. Ignoring request.", stat->ID, stat->filename);
+		return;
+	}
+	
+	if (f->n < 3) {
+		Log("Client (ID %d) sent an invalid SENDF command. Ignoring request.", stat->ID);
+		return;
+	}
+	if (!ValidFilename(f->at[2])) {
+		RefuseTransfer(i, "Cannot download a file named '%s'.", f->at[2]);
+		return;
+	}
+	char *sender = f->at[0];
+	char *receiver = f->at[1];
+	snprintf(stat->filename, MAX_FILENAME, "%s", f->at[2]);
 	
-	char *sender = strtok(listen, " ");
-	char *receiver = strtok(NULL, " ");
-	char *filename = strtok(NULL, "");
+	// A client resuming a download follows the receiver with the number of bytes it already has
+	off_t off = 0;
+	char *offset = strchr(receiver, ':');
+	if (offset != NULL) {
+		*offset = '\0';
+		if ((off = atol(offset + 1)) < 0)
+			off = 0;
+	}
+	
+	// Files that were uploaded or downloaded recently are sent straight from the file cache
+	struct CACHED_FILE * cached = CacheFind(stat->filename);
+	if (cached != NULL) {
+		StartDownload(stat, i, cached, sender, receiver, off);
+		return;
+	}
 	
-	// Remove the final newline character from the filename
-	int last = strlen(filename);
-	if (filename[last-1] == '\n')
-		filename[last-1] = '\0';
+	// Otherwise have the I/O threads load the requested file into the cache. The file is sent once that is done
+	struct IO_JOB * job = NewJob(IO_OPEN, stat->filename);
+	job->handle = HANDLE(i);
+	snprintf(job->user, sizeof(job->user), "%s", sender);
+	snprintf(job->recip, sizeof(job->recip), "%s", receiver);
+	job->off = off;
+	stat->ioBusy = 1;
+	SubmitIO(job);
+}
+
+// starts an upload on a data channel. args holds the stream id (followed by :<transfer id> for an upload that can be
+// resumed), the sender, the receiver (* for every user), the file size and the filename. Uploads on a channel follow
+// each other, so if the previous one is still being saved the command is left in place, and reading stops until
+// the previous upload is done. resume is set for RESUMEF, which carries on with what an earlier attempt saved
+void putf(struct CONN_STAT * stat, int i, struct FIELDS * f, int resume) {
+	if (stat->file != NULL) {
+		if (stat->fileOff + stat->nFile < stat->nToRecv) {
+			Log("Client (ID %d) started an upload before finishing '%s'. Closing connection.", stat->ID, stat->filename);
+			RemoveConnection(i);
+			return;
+		}
+		StopReading(i);
+		return;
+	}
 	
-	// Open the requested file to be read
-	FILE * reqFile;
-	if ((reqFile = fopen(filename, "r")) == NULL) {
-		Log("File '%s' not found in server database.", filename);
+	// The stream id may be followed by the transfer id of a resumable upload
+	char *idEnd = NULL, *sizeEnd = NULL;
+	long size = 0;
+	int xferLen = 0;
+	if (f->n == 5) {
+		stat->streamID = strtoul(f->at[0], &idEnd, 10);
+		if (*idEnd == ':')
+			xferLen = f->len[0] - (idEnd + 1 - f->at[0]);
+		size = strtol(f->at[3], &sizeEnd, 10);
+	}
+	if (stat->framing != FRAMING_V2 || f->n < 5 || idEnd == f->at[0] || (*idEnd != '\0' && *idEnd != ':') || xferLen > XFER_LEN || (xferLen > 0 && strspn(idEnd + 1, "0123456789abcdef") != xferLen) || (resume && xferLen == 0)
+			|| f->len[1] > MAX_CRED || f->len[2] > MAX_CRED || *sizeEnd != '\0' || size < 0 || size > MAX_REQUEST_SIZE || f->len[4] >= MAX_FILENAME) {
+		Log("Client (ID %d) sent an invalid %s command. Closing connection.", stat->ID, msgNames[resume ? RESUMEF : PUTF]);
 		RemoveConnection(i);
 		return;
 	}
+	if (!ValidFilename(f->at[4])) {
+		RefuseTransfer(i, "Cannot upload a file named '%s'.", f->at[4]);
+		return;
+	}
+	memcpy(stat->xfer, idEnd + 1, xferLen);
+	stat->xfer[xferLen] = '\0';
+	memcpy(stat->fileUser, f->at[1], f->len[1] + 1);
+	memcpy(stat->filename, f->at[4], f->len[4] + 1);
+	snprintf(stat->fileRecip, sizeof(stat->fileRecip), "%s", strcmp(f->at[2], "*") ? f->at[2] : "");
+	stat->nToRecv = size;
+	stat->nChunk = 0;
+	stat->channel = 1;
+	stat->nCmdRecv = 0;
 	
-	// Find the filesize of the file
-	fseek(reqFile, 0, SEEK_END);
-	stat->nToSend = ftell(reqFile);
-	fseek(reqFile, 0, SEEK_SET);
+	Log("SERVER receiving file '%s' (%ld bytes) from user '%s' on data channel (ID %d).", stat->filename, size, stat->fileUser, stat->ID);
+	BeginUpload(i, stat, resume);
+}
+
+// Makes sure a connection's receive buffer can hold len bytes plus a terminating null character
+void ReserveRecv(struct CONN_STAT * stat, int len) {
+	if (stat->recvCap < len + 1) {
+		if ((stat->dataRecv = (char *)realloc(stat->dataRecv, len + 1)) == NULL) {
+			LogAt(LOG_ERROR, "Cannot allocate a %d byte receive buffer.", len + 1);
+			exit(-1);
+		}
+		stat->recvCap = len + 1;
+	}
+}
+
+// copies a chunk of an upload on a data channel into the upload buffer. If the buffer fills up while the previous
+// buffer is still being written, the rest of the chunk is left in place and reading stops until the write is done
+void putChunk(struct CONN_STAT * stat, int i) {
+	BYTE * data = (BYTE *)stat->args;
+	int len = stat->nCmdRecv - FRAME_HDR_LEN - PUSH_ID_LEN;
 	
-	// Allocate memory to store the file
-	stat->file = (char *)malloc(sizeof(char) * stat->nToSend);
-	memset(stat->file, 0, stat->nToSend);
+	// The chunk must belong to the upload in progress and fit in what is left of it
+	if (stat->nChunk == 0) {
+		unsigned int id = ((unsigned int)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+		if (len < 0 || stat->file == NULL || stat->committing || id != stat->streamID || stat->fileOff + stat->nFile + len > stat->nToRecv) {
+			Log("Client (ID %d) sent a file chunk that does not belong to an upload. Closing connection.", stat->ID);
+			RemoveConnection(i);
+			return;
+		}
+	}
 	
-	// Close the file and open it again at lower level to read without dealing with buffers
-	fclose(reqFile);
-	int fd;
-	if ((fd = open(filename, O_RDONLY)) == -1) {
-		Log("Server cannot open file '%s'. Closing connection.", filename);
+	while (stat->nChunk < len) {
+		if (stat->nFile == FILE_CHUNK) {
+			PumpUpload(i);
+			if (stat->nFile == FILE_CHUNK) {
+				StopReading(i);
+				return;
+			}
+		}
+		
+		int n = len - stat->nChunk;
+		if (n > FILE_CHUNK - stat->nFile)
+			n = FILE_CHUNK - stat->nFile;
+		memcpy(stat->file + stat->nFile, data + PUSH_ID_LEN + stat->nChunk, n);
+		stat->nFile += n;
+		stat->nChunk += n;
 	}
 	
-	// Attempt to read in the file into the allocated memory
-	int n;
-	if ((n = read(fd, stat->file, stat->nToSend)) != stat->nToSend) {
-		Log("Incorrect number of bytes (%d/%d) read from file '%s'. Closing connection.", n, connStat[i].nToRecv, filename);
+	stat->nChunk = 0;
+	stat->nCmdRecv = 0;
+	PumpUpload(i);
+}
+
+// expands a compressed file chunk in place into the FILEDATA frame it stands for, and handles it as one. The frame
+// is left as FILEDATA, so if the upload buffers are full it is not expanded again when it is picked up later
+void putCompressedChunk(struct CONN_STAT * stat, int i) {
+	BYTE chunk[PUSH_CHUNK];
+	int len = stat->nCmdRecv - FRAME_HDR_LEN - PUSH_ID_LEN;
+	int n = (stat->compress && len >= 0) ? DecompressChunk((BYTE *)stat->args + PUSH_ID_LEN, len, chunk, PUSH_CHUNK) : -1;
+	if (n < 0) {
+		Log("Client (ID %d) sent an invalid compressed file chunk. Closing connection.", stat->ID);
 		RemoveConnection(i);
 		return;
 	}
 	
-	// Close the requested file as it has already been read into memory
-	close(fd);
-	
-	// Generate the command for the client to receive the file
-	sprintf(stat->dataSend, "RECV %d %s", stat->nToSend, filename);
-	Log("SERVER sending file '%s' (%d bytes) from user '%s' to user '%s'.", filename, connStat[i].nToSend, sender, receiver);
-	// Initiate file transfer by sending the message
-	if (Send_NonBlocking(peers[i].fd, stat->dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == CMD_LEN) {
-		peers[i].events |= POLLWRNORM;
-		stat->nCmdSent = CMD_LEN;
-		stat->nSent = 0;
-	}
+	ReserveRecv(stat, FRAME_HDR_LEN + PUSH_ID_LEN + n);
+	stat->args = stat->dataRecv + FRAME_HDR_LEN;
+	memcpy(stat->args + PUSH_ID_LEN, chunk, n);
+	stat->nCmdRecv = FRAME_HDR_LEN + PUSH_ID_LEN + n;
+	stat->msg = FILEDATA;
+	putChunk(stat, i);
 }
 
 // Because of a strange behavior of the program, after transferring a file, one command 
 // sent by the receiver is lost. Thus, sending back an IDLE helps to prevent data loss
-void termTransfer(struct CONN_STAT * stat, int i, char * user) {
-	int last = strlen(user);
-	if (user[last-1] == '\n')
-		user[last-1] = '\0';
-		
+void termTransfer(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	char *user = (f->n > 0) ? f->at[0] : "";
+	
 	Log("SERVER ending file transfer process for user '%s'.", user);
+	conn_handle h;
+	if (FindOnline(user, &h)) {
+		DeliverCmd(h, IDLE, NULL);
+	}
+	
+	// The user name points into this connection's receive buffer, so only close the helper once it is no longer needed
 	RemoveConnection(i);
-	for (int j=1; j<=nConns; j++) {
-		if (!strcmp(user, connStat[j].user)) {
-			sprintf(connStat[j].dataSend, "IDLE");
-			connStat[j].nToSend = CMD_LEN;
-			if (Send_NonBlocking(peers[j].fd, connStat[j].dataSend, CMD_LEN, &connStat[j], &peers[j]) < 0 || connStat[j].nSent == CMD_LEN) {
-				connStat[j].nSent = 0;
-				connStat[j].nToSend = 0;
-				return;
-			}
-		}
+}
+
+// answers a client that announced v2 framing with the protocol version the server speaks, followed by the
+// capabilities the client asked for that the server will use
+void hello(struct CONN_STAT * stat, int i, struct FIELDS * f) {
+	// Capabilities follow the version
+	for (int k = 1; k < f->n; k++) {
+		if (!strcmp(f->at[k], PUSH_CAPABILITY) && stat->framing == FRAMING_V2)
+			stat->push = 1;
+		if (!strcmp(f->at[k], COMPRESS_CAPABILITY) && stat->framing == FRAMING_V2)
+			stat->compress = 1;
 	}
+	
+	Log("Client (ID %d) is using protocol version %d%s%s.", stat->ID, (stat->framing == FRAMING_V2) ? 2 : 1, stat->push ? " with pushed files" : "", stat->compress ? " with compression" : "");
+	SendCmd(i, HELLO, "%d%s%s", (stat->framing == FRAMING_V2) ? 2 : 1, stat->push ? " " PUSH_CAPABILITY : "", stat->compress ? " " COMPRESS_CAPABILITY : "");
 }
 
 // Based on the message received from the client, do something with the data
-void protocol (struct CONN_STAT * stat, int i, char * body) {
+void protocol (struct CONN_STAT * stat, int i, struct FIELDS * f) {
 	switch (stat->msg) {
 		case IDLE:
 			connStat[i].nCmdRecv = 0; // Intentionally do nothing
 			break;
 		case REGISTER:
-			reg(stat, i, body+1);
+			reg(stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case LOGIN:
-			login(stat, i, body+1);
+			login(stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case LOGOUT:
@@ -810,23 +2576,23 @@ void protocol (struct CONN_STAT * stat, int i, char * body) {
 			connStat[i].nCmdRecv = 0;
 			break;
 		case SEND:
-			msg(SEND, stat, i, body+1);
+			msg(SEND, stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case SEND2:
-			msg(SEND2, stat, i, body+1);
+			msg(SEND2, stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case SENDA:
-			msg(SENDA, stat, i, body+1);
+			msg(SENDA, stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case SENDA2:
-			msg(SENDA2, stat, i, body+1);
+			msg(SENDA2, stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case SENDF:
-			sendf(stat, i, body+1);
+			sendf(stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		case LIST:
@@ -834,25 +2600,443 @@ void protocol (struct CONN_STAT * stat, int i, char * body) {
 			connStat[i].nCmdRecv = 0;
 			break;
 		case RECVF:
+		case RECVF4:
 			recvf(stat, i);
 			break;
-		case RECVF4:
-			recvf4(stat, i);
+		case PUTF:
+			putf(stat, i, f, 0);
+			break;
+		case RESUMEF:
+			putf(stat, i, f, 1);
+			break;
+		case FILEDATA:
+			putChunk(stat, i);
+			break;
+		case FILEZ:
+			putCompressedChunk(stat, i);
 			break;
 		case TERMINATE:
-			termTransfer(stat, i, body+1);
+			termTransfer(stat, i, f);
+			connStat[i].nCmdRecv = 0;
+			break;
+		case HELLO:
+			hello(stat, i, f);
+			connStat[i].nCmdRecv = 0;
+			break;
+		case JOIN:
+			join(stat, i, f);
+			connStat[i].nCmdRecv = 0;
+			break;
+		case PART:
+			part(stat, i, f);
+			connStat[i].nCmdRecv = 0;
+			break;
+		case SENDC:
+			sendc(stat, i, f);
 			connStat[i].nCmdRecv = 0;
 			break;
 		default:
-			Log("ERROR Unknown message from client!");
+			LogAt(LOG_ERROR, "ERROR Unknown message from client!");
+			connStat[i].nCmdRecv = 0;
 	}
 }
 
-void DoServer(int svrPort) {
+// Accepts connections waiting on the listening socket until it would block or the server is full
+void AcceptConnections(int listenFD) {
+	struct sockaddr_in clientAddr;
+	socklen_t clientAddrLen;
+	
+	while (nConns < connLimit) {
+		clientAddrLen = sizeof(clientAddr);
+		int fd = accept(listenFD, (struct sockaddr *)&clientAddr, &clientAddrLen);
+		if (fd == -1) {
+			// The accept queue is empty, so go back to listening for new connections
+			acceptPending = 0;
+			peers[LISTEN_SLOT].events = POLLRDNORM;
+			return;
+		}
+		
+		SetNonBlockIO(fd);
+		int i = AllocConnection();
+		nConns++;
+		peers[i].fd = fd;
+		peers[i].events = POLLRDNORM;
+		peers[i].revents = 0;
+		
+		// The slot keeps its generation so handles to the previous connection stay stale
+		unsigned int gen = connStat[i].gen;
+		memset(&connStat[i], 0, sizeof(struct CONN_STAT));
+		connStat[i].gen = gen;
+		connStat[i].ID = __atomic_add_fetch(&connID, 1, __ATOMIC_RELAXED);
+		ReserveRecv(&connStat[i], CMD_LEN);
+		EngineAdd(i);
+	}
+	
+	// The server is full. Stop polling the listening socket until a connection is closed, 
+	// otherwise poll() would keep waking up for connections that cannot be accepted
+	acceptPending = 1;
+	peers[LISTEN_SLOT].events = 0;
+}
+
+// Receives the next command from a client in whichever framing that client uses. The first byte a client sends decides
+// its framing, as v2 frames start with PROTO_MAGIC, which never starts a v1 command. On success the command type is
+// stored in msg and its arguments in args. Returns 1 once a whole command has arrived, 0 if the socket would block,
+// or -1 if the connection failed
+int RecvFrame(int i) {
+	struct CONN_STAT * stat = &connStat[i];
+	int fd = peers[i].fd;
+	
+	if (stat->framing == FRAMING_UNKNOWN) {
+		if (Recv_NonBlocking(fd, stat->dataRecv, 1, stat, &peers[i]) < 0)
+			return -1;
+		if (stat->nRecv < 1)
+			return 0;
+		stat->framing = ((BYTE)stat->dataRecv[0] == PROTO_MAGIC) ? FRAMING_V2 : FRAMING_V1;
+	}
+	
+	if (stat->framing == FRAMING_V1) {
+		if (Recv_NonBlocking(fd, stat->dataRecv, CMD_LEN, stat, &peers[i]) < 0)
+			return -1;
+		if (stat->nRecv < CMD_LEN)
+			return 0;
+		stat->nCmdRecv = CMD_LEN;
+		stat->nRecv = 0;
+		stat->dataRecv[CMD_LEN] = '\0';
+		
+		// The command name runs up to the first space, and its arguments follow it
+		int nameLen = strcspn(stat->dataRecv, " ");
+		stat->args = stat->dataRecv + nameLen + (stat->dataRecv[nameLen] == ' ');
+		
+		// Convert the command name to its corresponding enumerated value
+		if ((stat->msg = MsgFromName(stat->dataRecv, nameLen)) == -1 || fromClient[stat->msg] != 1) {
+			LogAt(LOG_ERROR, "ERROR (conn %d): Unknown message %.*s received!", stat->ID, nameLen, stat->dataRecv);
+			return -1;
+		}
+		SplitArgs(stat->args, strlen(stat->args), msgFields[stat->msg], &stat->fields);
+		return 1;
+	}
+	
+	// v2 frames are received in two steps: the fixed size header, then the body whose length it gives
+	int type, len;
+	if (stat->nRecv < FRAME_HDR_LEN) {
+		if (Recv_NonBlocking(fd, stat->dataRecv, FRAME_HDR_LEN, stat, &peers[i]) < 0)
+			return -1;
+		if (stat->nRecv < FRAME_HDR_LEN)
+			return 0;
+	}
+	if (GetFrameHeader((BYTE *)stat->dataRecv, &type, &len) < 0) {
+		LogAt(LOG_ERROR, "ERROR (conn %d): Invalid frame header received!", stat->ID);
+		return -1;
+	}
+	if (!fromClient[type]) {
+		LogAt(LOG_ERROR, "ERROR (conn %d): Client sent %s, which only the server sends!", stat->ID, msgNames[type]);
+		return -1;
+	}
+	ReserveRecv(stat, FRAME_HDR_LEN + len);
+	if (Recv_NonBlocking(fd, stat->dataRecv, FRAME_HDR_LEN + len, stat, &peers[i]) < 0)
+		return -1;
+	if (stat->nRecv < FRAME_HDR_LEN + len)
+		return 0;
+	
+	stat->nCmdRecv = FRAME_HDR_LEN + len;
+	stat->nRecv = 0;
+	stat->msg = type;
+	stat->args = stat->dataRecv + FRAME_HDR_LEN;
+	stat->args[len] = '\0';
+	SplitArgs(stat->args, len, msgFields[stat->msg], &stat->fields);
+	return 1;
+}
+
+// Receives data on a client socket and acts on it. Returns 1 if a full command was handled and more data may be waiting,
+// 0 if the socket would block, or -1 if the connection was closed
+int ReadConnection(int i) {
+	unsigned int gen = connStat[i].gen;
+	uint64_t start = 0;
+	int type = 0;
+	
+	// Attempting to receive a command from the client
+	if (connStat[i].nCmdRecv == 0) {
+		int r = RecvFrame(i);
+		if (r < 0) {
+			RemoveConnection(i);
+			return -1;
+		}
+		
+		// Wait for the rest of the command to arrive
+		if (r == 0) {
+			return 0;
+		}
+		type = connStat[i].msg;
+		start = NowNs();
+		STAT_ADD(cmds[connStat[i].msg], 1);
+		
+		// If the received command is a file receive from the client, grab the sender, filesize, and filename from its fields.
+		// RECVF4 sends the file to one user, whose name comes first
+		struct FIELDS * f = &connStat[i].fields;
+		if (connStat[i].msg == RECVF || connStat[i].msg == RECVF4) {
+			int k = (connStat[i].msg == RECVF4);
+			if (f->n < 3 + k) {
+				Log("Client (ID %d) sent an invalid %s command. Closing connection.", connStat[i].ID, msgNames[connStat[i].msg]);
+				RemoveConnection(i);
+				return -1;
+			}
+			if (!ValidFilename(f->at[k + 2])) {
+				RefuseTransfer(i, "Cannot upload a file named '%s'.", f->at[k + 2]);
+				return -1;
+			}
+			char * sizeEnd;
+			long size = strtol(f->at[k + 1], &sizeEnd, 10);
+			if (sizeEnd == f->at[k + 1] || *sizeEnd != '\0' || size < 0 || size > MAX_REQUEST_SIZE) {
+				RefuseTransfer(i, "Invalid file size '%s', files may be 0 to %ld bytes.", f->at[k + 1], (long)MAX_REQUEST_SIZE);
+				return -1;
+			}
+			
+			// Save sender, receiver, filename, and filesize
+			snprintf(connStat[i].fileRecip, sizeof(connStat[i].fileRecip), "%s", k ? f->at[0] : "");
+			snprintf(connStat[i].fileUser, sizeof(connStat[i].fileUser), "%s", f->at[k]);
+			snprintf(connStat[i].filename, sizeof(connStat[i].filename), "%s", f->at[k + 2]);
+			connStat[i].nToRecv = size;
+		}
+		
+		// Start the upload. The file is written by the I/O threads as it arrives
+		if (connStat[i].msg == RECVF || connStat[i].msg == RECVF4)
+			BeginUpload(i, &connStat[i], 0);
+	}
+	
+	// Act on the received command
+	int queued = connStat[i].qLen;
+	protocol(&connStat[i], i, &connStat[i].fields);
+	
+	// Handlers may close the connection and release its slot
+	if (connStat[i].gen != gen) {
+		return -1;
+	}
+	
+	// Time the command until its reply has been sent. Commands that queue no reply, like IDLE or FILEDATA, are counted
+	// but not timed. Only one reply per connection is timed at once, so commands that arrive while one is being timed
+	// are not timed either
+	if (start != 0 && connStat[i].nCmdRecv == 0 && connStat[i].replyStart == 0 && connStat[i].qLen > queued) {
+		connStat[i].replyType = type;
+		connStat[i].replyStart = start;
+	}
+	
+	// A file upload that is still in progress leaves the command in place until the whole file has arrived
+	return connStat[i].nCmdRecv == 0;
+}
+
+// Carries on with a data channel once a disk operation of its upload has finished. The command that was waiting for
+// the operation is handled first, then anything that arrived while reading was stopped
+void ResumeChannel(int i) {
+	PumpUpload(i);
+	while (ReadConnection(i) > 0 && !connStat[i].closing);
+}
+
+// Acts on a disk operation that an I/O thread has finished. The connection it was submitted for may have closed in the
+// meantime, in which case whatever the operation left open is cleaned up
+void FinishIO(struct IO_JOB * job) {
+	int i = HandleToConn(job->handle);
+	struct CONN_STAT * stat = (i >= 0) ? &connStat[i] : NULL;
+	if (stat != NULL) {
+		stat->ioBusy = 0;
+		peers[i].events |= POLLRDNORM;
+	}
+	
+	switch (job->type) {
+		case IO_CREATE:
+		case IO_WRITE:
+			if (job->type == IO_WRITE) {
+				// The written buffer becomes the spare buffer again
+				if (stat != NULL && stat->file != NULL && stat->spare == NULL)
+					stat->spare = job->buf;
+				else
+					free(job->buf);
+			}
+			if (stat == NULL) {
+				// The upload was abandoned while the operation was in flight
+				struct IO_JOB * abort = NewJob(IO_ABORT, job->filename);
+				abort->fd = job->fd;
+				strcpy(abort->xfer, job->xfer);
+				SubmitIO(abort);
+				break;
+			}
+			if (job->err) {
+				LogAt(LOG_ERROR, "Cannot %s file '%s' for user '%s' (%d: %s). Closing connection.", (job->type == IO_CREATE) ? "create" : "write to", job->filename, stat->fileUser, job->err, strerror(job->err));
+				if (job->type == IO_CREATE)
+					stat->fileFD = -1;
+				RemoveConnection(i);
+				break;
+			}
+			if (job->type == IO_CREATE)
+				stat->fileFD = job->fd;
+			
+			// Let the client know where to carry on with a resumed upload
+			if (job->type == IO_CREATE && job->resume) {
+				stat->fileOff = job->off;
+				Log("SERVER resuming file '%s' from user '%s' at %ld of %ld bytes.", stat->filename, stat->fileUser, (long)stat->fileOff, (long)stat->nToRecv);
+				SendCmd(i, OFFSET, "%u %ld", stat->streamID, (long)stat->fileOff);
+			}
+			
+			// Carry on with the upload, reading anything that arrived while reading was stopped
+			if (stat->channel)
+				ResumeChannel(i);
+			else
+				recvf(stat, i);
+			break;
+		case IO_COMMIT:
+			if (job->err) {
+				LogAt(LOG_ERROR, "Cannot save file '%s' from user '%s' (%d: %s).", job->filename, job->user, job->err, strerror(job->err));
+			}
+			else {
+				Log("SERVER received file '%s' from user '%s'%s.", job->filename, job->user, job->duplicate ? " (already stored, sharing the existing copy)" : "");
+				AnnounceUpload(job);
+			}
+			
+			if (stat == NULL)
+				break;
+			
+			// A data channel lets the client know the file was saved and moves on to its next upload, while a helper
+			// socket is closed after queueing messages to send to logged in clients
+			if (stat->channel) {
+				if (job->err)
+					SendCmd(i, ERROR, "Cannot save file '%s'.", job->filename);
+				else
+					SendCmd(i, ACKF, "%u %ld", stat->streamID, (long)stat->nToRecv);
+				free(stat->file);
+				free(stat->spare);
+				stat->file = NULL;
+				stat->spare = NULL;
+				stat->committing = 0;
+				ResumeChannel(i);
+			}
+			else {
+				RemoveConnection(i);
+			}
+			break;
+		case IO_OPEN:
+			if (job->err) {
+				Log("File '%s' not found in server database.", job->filename);
+				if (stat != NULL)
+					RemoveConnection(i);
+				break;
+			}
+			if (stat == NULL) {
+				CacheRelease(job->cached);
+				break;
+			}
+			StartDownload(stat, i, job->cached, job->user, job->recip, job->off);
+			break;
+		default:
+			break;
+	}
+	free(job);
+}
+
+// Handles everything other reactors have posted to this reactor's mailbox
+void ReadMail() {
+	struct REACTOR * reactor = &reactors[reactorID];
+	uint64_t count;
+	
+	// Reset the eventfd first, so mail posted while the mailbox is being emptied wakes the reactor again
+	if (read(reactor->mailFD, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		LogAt(LOG_ERROR, "Cannot read reactor %d mailbox (%d: %s).", reactorID, errno, strerror(errno));
+		exit(-1);
+	}
+	
+	pthread_mutex_lock(&reactor->mailLock);
+	struct MAIL * m = reactor->mailHead;
+	reactor->mailHead = NULL;
+	reactor->mailTail = NULL;
+	pthread_mutex_unlock(&reactor->mailLock);
+	
+	while (m != NULL) {
+		struct MAIL * next = m->next;
+		switch (m->kind) {
+			case MAIL_CMD: {
+				// The connection may have closed since the mail was posted
+				int i = HandleToConn(m->handle);
+				if (i >= 0)
+					QueueCmd(i, m->type, m->body, m->len);
+				break;
+			}
+			case MAIL_BROADCAST:
+				BroadcastLocal(m->frames);
+				break;
+			case MAIL_CHANNEL:
+				MulticastLocal((conn_handle *)m->body, m->len / sizeof(conn_handle), m->frames);
+				break;
+			case MAIL_FILE:
+				AnnounceFile(m->handle, m->body);
+				break;
+			case MAIL_IO:
+				FinishIO(m->job);
+				break;
+		}
+		free(m);
+		m = next;
+		STAT_ADD(mailQueued, -1);
+	}
+}
+
+// Sends the queued frames of a client socket and the file it is downloading, closing the connection if the send fails
+void WriteConnection(int i) {
+	while (1) {
+		if (FlushQueue(i) < 0) {
+			if (connStat[i].isFileRequest)
+				Log("Error sending file '%s' to user '%s'. Closing connection with helper.", connStat[i].filename, connStat[i].user);
+			RemoveConnection(i);
+			return;
+		}
+		
+		// Files pushed to the client go out one chunk at a time, each once the frames ahead of it are gone
+		if (connStat[i].qLen == 0 && connStat[i].pushHead != NULL && !connStat[i].isFileRequest && !connStat[i].closing) {
+			QueuePushChunk(i);
+			continue;
+		}
+		
+		// The file is sent once the frames ahead of it are gone
+		if (!connStat[i].isFileRequest || connStat[i].nAhead > 0) {
+			return;
+		}
+		
+		int r = SendFileData(i);
+		if (r < 0) {
+			Log("Error sending file '%s' to user '%s'. Closing connection with helper.", connStat[i].filename, connStat[i].user);
+			RemoveConnection(i);
+			return;
+		}
+		if (r == 0) {
+			return;
+		}
+		
+		// The file request is complete. Go around again to send any frames that were queued behind the file
+		Log("SERVER successfully sent file '%s' (%ld bytes).", connStat[i].filename, (long)connStat[i].nToSend);
+		CacheRelease(connStat[i].sendFile);
+		connStat[i].isFileRequest = 0;
+	}
+}
+
+// Sends everything that was queued while handling the last batch of events
+void FlushPending() {
+	for (int k=0; k<pendingFlush.len; k++) {
+		int i = HandleToConn(pendingFlush.handles[k]);
+		if (i >= 0 && !connStat[i].closing) {
+			connStat[i].flushPending = 0;
+			WriteConnection(i);
+		}
+	}
+	pendingFlush.len = 0;
+}
+
+// Runs the event loop of one reactor. Every reactor has its own listening socket bound to the server port with
+// SO_REUSEPORT, so the kernel spreads incoming connections across the reactors
+void * RunReactor(void * arg) {
+	reactorID = (int)(intptr_t)arg;
+	int svrPort = reactors[reactorID].port;
+	
 	// Create the nonblocking socket that listens for incoming connections
 	int listenFD = socket(AF_INET, SOCK_STREAM, 0);
 	if (listenFD < 0) {
-		Log("Cannot create listening socket.");
+		LogAt(LOG_ERROR, "Cannot create listening socket.");
 		exit(-1);
 	}
 	SetNonBlockIO(listenFD);
@@ -864,195 +3048,305 @@ void DoServer(int svrPort) {
 	serverAddr.sin_port = htons((unsigned short) svrPort);
 	serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	// Set the socket options and ignore the SIGPIPE signal
+	// Set the socket options
 	int optval = 1;
 	int r = setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
 	if (r != 0) {
-		Log("Cannot enable SO_REUSEADDR option.");
+		LogAt(LOG_ERROR, "Cannot enable SO_REUSEADDR option.");
+		exit(-1);
+	}
+	if (nReactors > 1 && setsockopt(listenFD, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
+		LogAt(LOG_ERROR, "Cannot enable SO_REUSEPORT option.");
 		exit(-1);
 	}
-	signal(SIGPIPE, SIG_IGN);
 
 	// Bind the listening socket to the specified port number
 	if (bind(listenFD, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) != 0) {
-		Log("Cannot bind to port %d.", svrPort);
+		LogAt(LOG_ERROR, "Cannot bind to port %d.", svrPort);
 		exit(-1);
 	}
 	
 	// Listen to the listening socket for incoming connections
 	if (listen(listenFD, 16) != 0) {
-		Log("Cannot listen to port %d.", svrPort);
+		LogAt(LOG_ERROR, "Cannot listen to port %d.", svrPort);
 		exit(-1);
 	}
 	
-	// Initialize global variable values and socket info structs
-	connID = 0;
+	// Initialize global variable values and socket info structs. The connection limit is split evenly between the reactors
 	nConns = 0;	
-	memset(peers, 0, sizeof(peers));	
-	peers[0].fd = listenFD;
-	peers[0].events = POLLRDNORM;	
-	memset(connStat, 0, sizeof(connStat));
+	connLimit = (maxConns + nReactors - 1) / nReactors;
+	acceptPending = 0;
+	freeSlot = -1;
+	connHigh = FIRST_SLOT;
+	connCap = (connLimit + FIRST_SLOT < 64) ? connLimit + FIRST_SLOT : 64;
+	peers = (struct pollfd *)calloc(connCap, sizeof(struct pollfd));
+	connStat = (struct CONN_STAT *)calloc(connCap, sizeof(struct CONN_STAT));
+	ready = (struct EVENT *)calloc(connCap > MAX_EVENTS ? connCap : MAX_EVENTS, sizeof(struct EVENT));
+	if (peers == NULL || connStat == NULL || ready == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate connection table.");
+		exit(-1);
+	}
+	peers[LISTEN_SLOT].fd = listenFD;
+	peers[LISTEN_SLOT].events = POLLRDNORM;	
+	peers[MAILBOX_SLOT].fd = reactors[reactorID].mailFD;
+	peers[MAILBOX_SLOT].events = POLLIN; // eventfd only reports POLLIN, not POLLRDNORM
+	EngineInit();
+	Log("SERVER reactor %d listening on port %d using %s (up to %d connections).", reactorID, svrPort, (engine == ENGINE_EPOLL) ? "epoll" : "poll", connLimit);
 	
 	// The main loop for carrying out nonblocking operations
 	while (1) {			
-		// Poll for any events happening on any open connection
-		r = poll(peers, nConns + 1, -1);	
-		if (r < 0) {
-			Log("Invalid poll() return value.");
-			exit(-1);
-		}			
-		
-		struct sockaddr_in clientAddr;
-		socklen_t clientAddrLen = sizeof(clientAddr);	
+		// Wait for events on any open connection. Only the sockets that are ready are visited below
+		int nReady = EngineWait();
 		
-		// A new connection is being requested, accept and initialize info structs
-		if ((peers[0].revents & POLLRDNORM) && (nConns < MAX_CONCURRENCY_LIMIT)) {					
-			int fd = accept(listenFD, (struct sockaddr *)&clientAddr, &clientAddrLen);
-			if (fd != -1) {
-				SetNonBlockIO(fd);
-				nConns++;
-				peers[nConns].fd = fd;
-				peers[nConns].events = POLLRDNORM;
-				peers[nConns].revents = 0;
-				
-				memset(&connStat[nConns], 0, sizeof(struct CONN_STAT));
-				connStat[nConns].ID = ++connID;
+		for (int k=0; k<nReady; k++) {
+			// A new connection is being requested, accept and initialize info structs
+			if (ready[k].handle == HANDLE(LISTEN_SLOT)) {
+				AcceptConnections(listenFD);
+				continue;
 			}
-		}
-		
-		// For all data sockets, check what event has occured and on which socket
-		for (int i=1; i<=nConns; i++) {
-			// A data socket is requesting to receive data
-			if (peers[i].revents & (POLLRDNORM | POLLERR | POLLHUP)) {
-				int fd = peers[i].fd;
-				char * split;
-				
-				// Attempting to receive a command from the client
-				if (connStat[i].nCmdRecv < CMD_LEN) {
-					if (Recv_NonBlocking(fd, (BYTE *)&connStat[i].dataRecv, CMD_LEN, &connStat[i], &peers[i]) < 0) {
-						RemoveConnection(i);
-						continue;
-					}
-					
-					// If full command has been received, parse it for what action to take next
-					if (connStat[i].nRecv == CMD_LEN) {
-						connStat[i].nCmdRecv = connStat[i].nRecv;
-						connStat[i].nRecv = 0;
-						
-						// Insert null character to terminate string after command type
-						split = strchr(connStat[i].dataRecv, ' ');
-						if (split != NULL) {
-							*split = '\0';
-						}
-		
-						// Convert the command string to its corresponding enumerated value
-						if ((connStat[i].msg = strToMsg(connStat[i].dataRecv)) == -1) {
-							Log("ERROR (conn %d): Unknown message %s received!", connStat[i].ID, connStat[i].dataRecv);
-							RemoveConnection(i);
-						}
-						
-						// If the received command is a file receive from the client, parse through the command to grab the sender, filesize, and filename
-						if (connStat[i].msg == RECVF) {
-							char *user = strtok(split+1, " ");
-							char *filesize = strtok(NULL, " ");
-							char *filename = strtok(NULL, " ");
-							
-							// Remove the final newline from the filename
-							int len = strlen(filename);
-							if (filename[len-1] == '\n') {
-								filename[len-1] = '\0';
-							}
-							
-							// Save user, filename, and filesize and allocate memory for receiving the file
-							sprintf(connStat[i].fileUser, "%s", user);
-							sprintf(connStat[i].filename, "%s", filename);
-							connStat[i].nToRecv = atoi(filesize);
-							connStat[i].file = (char *)malloc(sizeof(char) * connStat[i].nToRecv);
-						}
-						
-						// If we will only send to one user, parse through the command to grab the receiver, sender, filesize, and filename
-						if (connStat[i].msg == RECVF4) {
-							char *target = strtok(split+1, " ");
-							char *source = strtok(NULL, " ");
-							char *filesize = strtok(NULL, " ");
-							char *filename = strtok(NULL, " ");
-							
-							// Remove the final newline from the filename
-							int len = strlen(filename);
-							if (filename[len-1] == '\n') {
-								filename[len-1] = '\0';
-							}
-							
-							// Save sender, receiver, filename, and filesize and allocate memory for receiving the file
-							sprintf(connStat[i].fileRecip, "%s", target);
-							sprintf(connStat[i].fileUser, "%s", source);
-							sprintf(connStat[i].filename, "%s", filename);
-							connStat[i].nToRecv = atoi(filesize);
-							connStat[i].file = (char *)malloc(sizeof(char) * connStat[i].nToRecv);
-						}
-					}
-				}
+			
+			// Another reactor has posted commands for the connections of this one
+			if (ready[k].handle == HANDLE(MAILBOX_SLOT)) {
+				ReadMail();
+				continue;
+			}
+			
+			// Skip events for sockets that were closed earlier in this batch
+			int i = HandleToConn(ready[k].handle);
+			if (i < 0 || connStat[i].closing) {
+				continue;
+			}
+			
+			// A data socket is requesting to receive data. Events are edge-triggered with epoll,
+			// so keep handling commands until the socket has no more data
+			if (ready[k].revents & (POLLRDNORM | POLLERR | POLLHUP)) {
+				int rc;
+				while ((rc = ReadConnection(i)) > 0 && !connStat[i].closing);
 				
-				// Act on the received command
-				if (connStat[i].nCmdRecv == CMD_LEN) {
-					protocol(&connStat[i], i, split);
+				// Close connections whose sends failed while handling the commands
+				ReapConnections();
+				if (rc < 0 || HandleToConn(ready[k].handle) < 0) {
+					continue;
 				}
-				
 			}
 			
-			//a previously blocked data socket becomes writable
-			if (peers[i].revents & POLLWRNORM) {
-				if (connStat[i].isFileRequest) {
-					if (connStat[i].nCmdSent < CMD_LEN) {
-						if (Send_NonBlocking(peers[i].fd, connStat[i].dataSend, CMD_LEN, &connStat[i], &peers[i]) < 0) {
-							Log("Error sending LISTEN file request command to user '%s'. Closing connection with helper.", connStat[i].user);
-							RemoveConnection(i);
-						}
-						if (connStat[i].nSent == CMD_LEN) {
-							connStat[i].nCmdSent = CMD_LEN;
-							connStat[i].nSent = 0;
-						}
-					}
-					if (connStat[i].nCmdSent == CMD_LEN && connStat[i].nSent < connStat[i].nToSend) {
-						if (Send_NonBlocking(peers[i].fd, connStat[i].file, connStat[i].nToSend, &connStat[i], &peers[i]) < 0) {
-							Log("Error sending file '%s' to user '%s'. Closing connection with helper.", connStat[i].filename, connStat[i].user);
-							RemoveConnection(i);
-						}
-						if (connStat[i].nSent == CMD_LEN) {
-							Log("SERVER successfully sent file '%s' (%d bytes) to user '%s'", connStat[i].filename, connStat[i].nToSend, connStat[i].user);
-							free(connStat[i].file);
-							connStat[i].nSent = 0;
-							connStat[i].nCmdSent = 0;
-							continue;
-						}
-					}
-				}
-				else {
-					if (Send_NonBlocking(peers[i].fd, connStat[i].dataSend, connStat[i].nToSend, &connStat[i], &peers[i]) < 0 || connStat[i].nSent == connStat[i].nToSend) {
-						connStat[i].nToSend = 0;
-						connStat[i].nSent = 0;
-						continue;
-					}
-				}
+			// A previously blocked data socket becomes writable again
+			if ((ready[k].revents & POLLWRNORM) && (peers[i].events & POLLWRNORM)) {
+				WriteConnection(i);
 			}
-
+		}
+		
+		// Send the frames queued while handling this batch. A connection that was sent several frames
+		// (e.g. a burst of broadcasts) has them all written at once. Sockets that block are picked up
+		// again by their next POLLOUT event
+		FlushPending();
+		ReapConnections();
+		
+		// Connections that were left in the accept queue can be accepted now that slots have been freed
+		if (acceptPending && nConns < connLimit) {
+			AcceptConnections(listenFD);
 		}
 	}	
+	
+	return NULL;
+}
+
+// Returns the time in microseconds under which a fraction of the samples in a latency histogram fall
+uint64_t LatencyPercentile(const unsigned long * hist, unsigned long total, double fraction) {
+	unsigned long seen = 0;
+	for (int b=0; b<LATENCY_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > 0 && seen >= total * fraction)
+			return BucketLatency(b);
+	}
+	return BucketLatency(LATENCY_BUCKETS - 1);
+}
+
+// Logs the totals of every reactor's stats since the server started: traffic, queue depths, and for each command how many
+// arrived and how long their replies took
+void LogStats() {
+	static unsigned long hist[LATENCY_BUCKETS];
+	unsigned long bytesIn = 0, bytesOut = 0;
+	long sendQueued = 0, mailQueued = 0;
+	for (int r=0; r<nReactors; r++) {
+		struct STATS * st = &reactors[r].stats;
+		bytesIn += __atomic_load_n(&st->bytesIn, __ATOMIC_RELAXED);
+		bytesOut += __atomic_load_n(&st->bytesOut, __ATOMIC_RELAXED);
+		sendQueued += __atomic_load_n(&st->sendQueued, __ATOMIC_RELAXED);
+		mailQueued += __atomic_load_n(&st->mailQueued, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&ioLock);
+	long diskQueued = ioQueued;
+	pthread_mutex_unlock(&ioLock);
+	Log("STATS: %lu bytes received, %lu bytes sent. Waiting: %ld frames to send, %ld mail, %ld disk operations.", bytesIn, bytesOut, sendQueued, mailQueued, diskQueued);
+	
+	for (int type=0; type<NUM_MSG_TYPES; type++) {
+		unsigned long count = 0, timed = 0;
+		memset(hist, 0, sizeof(hist));
+		for (int r=0; r<nReactors; r++) {
+			struct STATS * st = &reactors[r].stats;
+			count += __atomic_load_n(&st->cmds[type], __ATOMIC_RELAXED);
+			for (int b=0; b<LATENCY_BUCKETS; b++)
+				hist[b] += __atomic_load_n(&st->latency[type][b], __ATOMIC_RELAXED);
+		}
+		if (count == 0)
+			continue;
+		const char * name = msgNames[type];
+		int nameLen = strcspn(name, "\n"); // LOGOUT and LIST are sent with a newline
+		for (int b=0; b<LATENCY_BUCKETS; b++)
+			timed += hist[b];
+		if (timed == 0) {
+			Log("STATS %.*s: %lu received.", nameLen, name, count);
+			continue;
+		}
+		Log("STATS %.*s: %lu received, reply latency p50 %lu us, p90 %lu us, p99 %lu us, max %lu us (%lu timed).", nameLen, name, count,
+			(unsigned long)LatencyPercentile(hist, timed, 0.5), (unsigned long)LatencyPercentile(hist, timed, 0.9),
+			(unsigned long)LatencyPercentile(hist, timed, 0.99), (unsigned long)LatencyPercentile(hist, timed, 1.0), timed);
+	}
+}
+
+// Stats thread, logs the stats every statsInterval seconds
+void * RunStats(void * arg) {
+	while (1) {
+		sleep(statsInterval);
+		LogStats();
+	}
+	return NULL;
+}
+
+// Sets up the tables shared by every reactor, then starts the I/O threads and the reactor threads. This thread runs reactor 0
+void DoServer(int svrPort) {
+	// Ignore the SIGPIPE signal
+	signal(SIGPIPE, SIG_IGN);
+	
+	// Each reactor takes up to maxConns/nReactors connections rounded up, so together they can hold a few more than maxConns
+	connID = 0;
+	int totalConns = nReactors * ((maxConns + nReactors - 1) / nReactors);
+	onlineCap = 64;
+	while (onlineCap < (totalConns + 1) * 2)
+		onlineCap *= 2;
+	online = (struct ONLINE_USER *)calloc(onlineCap, sizeof(struct ONLINE_USER));
+	channelCap = 64;
+	while (channelCap < MAX_CHANNELS * 2)
+		channelCap *= 2;
+	channels = (struct CHANNEL *)calloc(channelCap, sizeof(struct CHANNEL));
+	reactors = (struct REACTOR *)calloc(nReactors, sizeof(struct REACTOR));
+	if (online == NULL || channels == NULL || reactors == NULL) {
+		LogAt(LOG_ERROR, "Cannot allocate server tables.");
+		exit(-1);
+	}
+	
+	for (int r=0; r<nReactors; r++) {
+		reactors[r].port = svrPort;
+		pthread_mutex_init(&reactors[r].mailLock, NULL);
+		if ((reactors[r].mailFD = eventfd(0, EFD_NONBLOCK)) < 0) {
+			LogAt(LOG_ERROR, "Cannot create mailbox for reactor %d.", r);
+			exit(-1);
+		}
+	}
+	
+	for (int k=0; k<nIOThreads; k++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, IOWorker, NULL) != 0) {
+			LogAt(LOG_ERROR, "Cannot start I/O thread %d.", k);
+			exit(-1);
+		}
+	}
+	
+	if (statsInterval > 0) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, RunStats, NULL) != 0) {
+			LogAt(LOG_ERROR, "Cannot start the stats thread.");
+			exit(-1);
+		}
+	}
+	
+	for (int r=1; r<nReactors; r++) {
+		if (pthread_create(&reactors[r].thread, NULL, RunReactor, (void *)(intptr_t)r) != 0) {
+			LogAt(LOG_ERROR, "Cannot start reactor %d.", r);
+			exit(-1);
+		}
+	}
+	RunReactor((void *)0);
 }
 
 int main(int argc, char * * argv) {	
-	if (argc != 2) {
-		Log("Usage: %s [server Port]/['reset']", argv[0]);
-		return -1;
+	int opt;
+	
+	// Start logging before anything has a chance to log
+	StartLog();
+	
+	// Build the command name table before any reactor starts decoding commands
+	InitMsgTable();
+	
+	// Use epoll unless the poll fallback was requested
+	engine = ENGINE_EPOLL;
+	maxConns = MAX_CONCURRENCY_LIMIT;
+	nReactors = 1;
+	nIOThreads = IO_THREADS;
+	while ((opt = getopt(argc, argv, "e:c:t:w:l:s:")) != -1) {
+		switch (opt) {
+			case 'e':
+				if (!strcmp(optarg, "poll"))
+					engine = ENGINE_POLL;
+				else if (!strcmp(optarg, "epoll"))
+					engine = ENGINE_EPOLL;
+				else {
+					Log("Unknown event engine '%s' (expected 'epoll' or 'poll').", optarg);
+					return -1;
+				}
+				break;
+			case 'c':
+				if ((maxConns = atoi(optarg)) <= 0) {
+					Log("Connection limit must be a positive number.");
+					return -1;
+				}
+				break;
+			case 't':
+				if ((nReactors = atoi(optarg)) <= 0 || nReactors > MAX_REACTORS) {
+					Log("Number of reactor threads must be between 1 and %d.", MAX_REACTORS);
+					return -1;
+				}
+				break;
+			case 'w':
+				if ((nIOThreads = atoi(optarg)) <= 0) {
+					Log("Number of I/O threads must be a positive number.");
+					return -1;
+				}
+				break;
+			case 's':
+				if ((statsInterval = atoi(optarg)) <= 0) {
+					Log("Stats interval must be a positive number of seconds.");
+					return -1;
+				}
+				break;
+			case 'l':
+				if (!strcmp(optarg, "error"))
+					logLevel = LOG_ERROR;
+				else if (!strcmp(optarg, "info"))
+					logLevel = LOG_INFO;
+				else if (!strcmp(optarg, "debug"))
+					logLevel = LOG_DEBUG;
+				else {
+					Log("Unknown log level '%s' (expected 'error', 'info' or 'debug').", optarg);
+					return -1;
+				}
+				break;
+			default:
+				Log("Usage: %s [-e epoll|poll] [-c max connections] [-t reactor threads] [-w I/O threads] [-l error|info|debug] [-s stats seconds] [server Port]/['reset']", argv[0]);
+				return -1;
+		}
 	}
 	
-	// Allocating memory for timestamp generation
-	timestamp = (char *)malloc(sizeof(char) * 11);
+	if (argc - optind != 1) {
+		Log("Usage: %s [-e epoll|poll] [-c max connections] [-t reactor threads] [-w I/O threads] [-l error|info|debug] [-s stats seconds] [server Port]/['reset']", argv[0]);
+		return -1;
+	}
 	
 	// grab the port number, or check if the server should reset its database
-	int port = atoi(argv[1]);
-	if (!strcmp(argv[1], "reset")) {
-		if (remove("registered_accounts.txt") == 0) {
+	int port = atoi(argv[optind]);
+	if (!strcmp(argv[optind], "reset")) {
+		if (remove(ACCOUNT_FILE) == 0) {
 			Log("Resetting accounts database.");
 			return 0;
 		}
@@ -1062,11 +3356,16 @@ int main(int argc, char * * argv) {
 		}
 	}
 	else if(port == 0) {
-		Log("Usage: %s [server Port]/['reset']", argv[0]);
+		Log("Usage: %s [-e epoll|poll] [-c max connections] [-t reactor threads] [-w I/O threads] [-l error|info|debug] [-s stats seconds] [server Port]/['reset']", argv[0]);
 		return -1;
 	}
 	
-	// perform server actions on specified port
+	// Load the registered accounts and make sure there is somewhere to store uploads, then perform server actions on specified port
+	LoadAccounts();
+	if (mkdir(STORE_DIR, 0755) != 0 && errno != EEXIST) {
+		LogAt(LOG_ERROR, "Cannot create the file store '%s' (%d: %s).", STORE_DIR, errno, strerror(errno));
+		return -1;
+	}
 	DoServer(port);
 	
 	// this should never be reached